@@ -34,6 +34,10 @@ const VALID_TIMING valid_timings[] =
     {TWAI_TIMING_CONFIG_25KBITS(), 0} //this is a terminator record. When the code sees an entry with 0 speed it stops searching
 };
 
+//beginAutoSpeed tries these first, most common in vehicles first. Everything else in
+//valid_timings follows in table order.
+const uint32_t autobaud_order[] = {500000, 250000, 125000, 1000000, 33333, 0};
+
 ESP32CAN::ESP32CAN(gpio_num_t rxPin, gpio_num_t txPin, uint8_t busNumber) : CAN_COMMON(32)
 {
     twai_general_cfg.rx_io = rxPin;
@@ -43,6 +47,37 @@ ESP32CAN::ESP32CAN(gpio_num_t rxPin, gpio_num_t txPin, uint8_t busNumber) : CAN_
     twai_general_cfg.tx_queue_len = BI_TX_BUFFER_SIZE;
     twai_general_cfg.rx_queue_len = 6;
     rxBufferSize = BI_RX_BUFFER_SIZE;
+    callbackQueueSize = BI_CB_QUEUE_SIZE;
+    txQueueSize = BI_TX_QUEUE_SIZE;
+    eventQueue = NULL;
+    tx_queue = NULL;
+    txGate = NULL;
+    txInDriver = 0;
+    txFailedSeen = 0;
+    callbackQueue = NULL;
+    rx_queue = NULL;
+    rxGate = NULL;
+    alertGate = NULL;
+    reconfiguring = false;
+    driverInstalled = false;
+    rxMode = ESP32_RX_QUEUE;
+    rxNotifyTask = NULL;
+    memset(&driverStats, 0, sizeof(driverStats));
+    twaiMissedBase = 0;
+    twaiOverrunBase = 0;
+    txQueueFullUngated = 0;
+    memset(filterTables, 0, sizeof(filterTables)); //both sets start out rejecting everything
+    activeTables = &filterTables[0];
+    readingTables = NULL;
+
+    for (int i = 0; i < BI_NUM_FILTERS; i++)
+    {
+        filters[i].id = 0;
+        filters[i].mask = 0;
+        filters[i].extended = false;
+        filters[i].configured = false;
+    }
+    compileFilters();
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
     bus_handle = nullptr;
@@ -58,6 +93,28 @@ ESP32CAN::ESP32CAN() : CAN_COMMON(BI_NUM_FILTERS)
     bus_handle = nullptr;
 #endif
     rxBufferSize = BI_RX_BUFFER_SIZE;
+    callbackQueueSize = BI_CB_QUEUE_SIZE;
+    txQueueSize = BI_TX_QUEUE_SIZE;
+    eventQueue = NULL;
+    tx_queue = NULL;
+    txGate = NULL;
+    txInDriver = 0;
+    txFailedSeen = 0;
+    callbackQueue = NULL;
+    rx_queue = NULL;
+    rxGate = NULL;
+    alertGate = NULL;
+    reconfiguring = false;
+    driverInstalled = false;
+    rxMode = ESP32_RX_QUEUE;
+    rxNotifyTask = NULL;
+    memset(&driverStats, 0, sizeof(driverStats));
+    twaiMissedBase = 0;
+    twaiOverrunBase = 0;
+    txQueueFullUngated = 0;
+    memset(filterTables, 0, sizeof(filterTables)); //both sets start out rejecting everything
+    activeTables = &filterTables[0];
+    readingTables = NULL;
 
     for (int i = 0; i < BI_NUM_FILTERS; i++)
     {
@@ -69,6 +126,7 @@ ESP32CAN::ESP32CAN() : CAN_COMMON(BI_NUM_FILTERS)
 
     readyForTraffic = false;
     cyclesSinceTraffic = 0;
+    compileFilters();
 }
 
 void ESP32CAN::setCANPins(gpio_num_t rxPin, gpio_num_t txPin)
@@ -77,41 +135,179 @@ void ESP32CAN::setCANPins(gpio_num_t rxPin, gpio_num_t txPin)
     twai_general_cfg.tx_io = txPin;
 }
 
+//Sleeps on the TWAI alerts so bus off recovery starts the moment it happens and every
+//error state change is turned into a timestamped event. Still counts 200ms periods
+//without traffic for beginAutoSpeed. Parks itself while the driver is down.
 void ESP32CAN::CAN_WatchDog_Builtin( void *pvParameters )
 {
     ESP32CAN* espCan = (ESP32CAN*)pvParameters;
     const TickType_t xDelay = 200 / portTICK_PERIOD_MS;
-    twai_status_info_t status_info;
+    TickType_t lastCycle = xTaskGetTickCount();
+    uint32_t alerts;
 
     for(;;)
     {
-        vTaskDelay( xDelay );
-        espCan->cyclesSinceTraffic++;
-
-        esp_err_t result;
+        bool parked = true;
+        xSemaphoreTake(espCan->alertGate, portMAX_DELAY);
+        if (espCan->readyForTraffic && !espCan->reconfiguring)
+        {
+            esp_err_t result;
+            parked = false;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-        result = twai_get_status_info_v2(espCan->bus_handle, &status_info);
+            result = twai_read_alerts_v2(espCan->bus_handle, &alerts, pdMS_TO_TICKS(BI_DRIVER_POLL_MS));
 #else
-        result = twai_get_status_info(&status_info);
+            result = twai_read_alerts(&alerts, pdMS_TO_TICKS(BI_DRIVER_POLL_MS));
 #endif
-        if (result == ESP_OK)
-        {
-            if (status_info.state == TWAI_STATE_BUS_OFF)
+            if (result == ESP_OK)
             {
-                espCan->cyclesSinceTraffic = 0;
+                espCan->serviceTX(alerts);
+                if (alerts & ~BI_TX_ALERTS) espCan->handleAlerts(alerts);
+            }
+            else espCan->serviceTX(0); //catches frames parked just after the last TX alert
+        }
+        xSemaphoreGive(espCan->alertGate);
+        if (parked) ulTaskNotifyTake(pdTRUE, xDelay); //unlockDriver() wakes us
+
+        if (xTaskGetTickCount() - lastCycle >= xDelay)
+        {
+            lastCycle += xDelay;
+            espCan->cyclesSinceTraffic++;
+        }
+    }
+}
+
+//Bookkeeping for the tx path: count what the controller finished since last time and
+//move parked frames into the driver tx queue as room frees up. Driver must be running.
+void ESP32CAN::serviceTX(uint32_t alerts)
+{
+    xSemaphoreTake(txGate, portMAX_DELAY);
+    if (txInDriver || uxQueueMessagesWaiting(tx_queue) || (alerts & BI_TX_ALERTS))
+    {
+        accountTX();
+        //bus off recovery empties the driver tx queue without counting anything as failed
+        if (alerts & TWAI_ALERT_BUS_OFF)
+        {
+            driverStats.txFailed += txInDriver;
+            txInDriver = 0;
+        }
+        pumpTX();
+    }
+    xSemaphoreGive(txGate);
+}
+
+//Frames that left the driver tx queue since the last call either went out or show up
+//in tx_failed_count. Only call with txGate held.
+void ESP32CAN::accountTX()
+{
+    twai_status_info_t info;
+    esp_err_t result;
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-                result = twai_initiate_recovery_v2(espCan->bus_handle);
+    result = twai_get_status_info_v2(bus_handle, &info);
 #else
-                result = twai_initiate_recovery();
+    result = twai_get_status_info(&info);
 #endif
-                if (result != ESP_OK)
-                {
-                    printf("Could not initiate bus recovery!\n");
-                }
-            }
+    if (result != ESP_OK) return;
+    uint32_t done = (txInDriver > info.msgs_to_tx) ? txInDriver - info.msgs_to_tx : 0;
+    uint32_t failed = info.tx_failed_count - txFailedSeen;
+    txFailedSeen = info.tx_failed_count;
+    driverStats.txFailed += failed;
+    driverStats.txSent += (done > failed) ? done - failed : 0;
+    txInDriver = info.msgs_to_tx;
+}
+
+//Move parked frames into the driver until it is full. A frame stays at the front of
+//tx_queue until the driver took it so the order never changes. Only call with txGate held.
+void ESP32CAN::pumpTX()
+{
+    twai_message_t msg;
+
+    while (xQueuePeek(tx_queue, &msg, 0) == pdTRUE)
+    {
+        esp_err_t result = transmit(msg);
+        if (result == ESP_ERR_TIMEOUT) break; //still full, the next TX alert brings us back
+        xQueueReceive(tx_queue, &msg, 0);
+        if (result == ESP_OK) txInDriver++;
+        else driverStats.txFailed++; //bus off, listen only... it is not going to go out
+    }
+}
+
+//hand one frame to the TWAI driver without waiting for room
+esp_err_t ESP32CAN::transmit(twai_message_t &msg)
+{
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    return twai_transmit_v2(bus_handle, &msg, 0);
+#else
+    return twai_transmit(&msg, 0);
+#endif
+}
+
+void ESP32CAN::handleAlerts(uint32_t alerts)
+{
+    uint32_t stamp = (uint32_t)esp_timer_get_time();
+    twai_status_info_t info;
+    esp_err_t result;
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    result = twai_get_status_info_v2(bus_handle, &info);
+#else
+    result = twai_get_status_info(&info);
+#endif
+    if (result != ESP_OK) memset(&info, 0, sizeof(info));
+
+    //in the order they normally happen so the event stream reads naturally
+    if (alerts & TWAI_ALERT_ARB_LOST) postEvent(ESP32_EVENT_ARB_LOST, stamp, info);
+    if (alerts & TWAI_ALERT_BUS_ERROR) postEvent(ESP32_EVENT_BUS_ERROR, stamp, info);
+#ifdef TWAI_ALERT_RX_FIFO_OVERRUN
+    if (alerts & (TWAI_ALERT_RX_QUEUE_FULL | TWAI_ALERT_RX_FIFO_OVERRUN)) postEvent(ESP32_EVENT_RX_OVERRUN, stamp, info);
+#else
+    if (alerts & TWAI_ALERT_RX_QUEUE_FULL) postEvent(ESP32_EVENT_RX_OVERRUN, stamp, info);
+#endif
+    if (alerts & TWAI_ALERT_ERR_PASS) postEvent(ESP32_EVENT_ERROR_PASSIVE, stamp, info);
+    if (alerts & TWAI_ALERT_BUS_OFF)
+    {
+        postEvent(ESP32_EVENT_BUS_OFF, stamp, info);
+        cyclesSinceTraffic = 0;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+        result = twai_initiate_recovery_v2(bus_handle);
+#else
+        result = twai_initiate_recovery();
+#endif
+        if (result != ESP_OK)
+        {
+            printf("Could not initiate bus recovery!\n");
         }
     }
+    if (alerts & TWAI_ALERT_BUS_RECOVERED)
+    {
+        postEvent(ESP32_EVENT_RECOVERED, stamp, info);
+        //recovery leaves the controller stopped
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+        twai_start_v2(bus_handle);
+#else
+        twai_start();
+#endif
+    }
+    if (alerts & TWAI_ALERT_ERR_ACTIVE) postEvent(ESP32_EVENT_ERROR_ACTIVE, stamp, info);
+}
+
+void ESP32CAN::postEvent(uint8_t type, uint32_t stamp, twai_status_info_t &info)
+{
+    ESP32_ERROR_EVENT event;
+
+    if (!eventQueue) return;
+    event.timestamp = stamp;
+    event.type = type;
+    event.txErrors = (info.tx_error_counter > 255) ? 255 : info.tx_error_counter;
+    event.rxErrors = (info.rx_error_counter > 255) ? 255 : info.rx_error_counter;
+    event.reserved = 0;
+    xQueueSend(eventQueue, &event, 0); //an error storm just loses the newest events
+}
+
+bool ESP32CAN::getErrorEvent(ESP32_ERROR_EVENT &event)
+{
+    if (!eventQueue) return false;
+    return xQueueReceive(eventQueue, &event, 0) == pdTRUE;
 }
 
 //infinitely loops accepting frames from the TWAI driver. Calls
@@ -123,29 +319,48 @@ void ESP32CAN::task_LowLevelRX(void *pvParameters)
     
     while (1)
     {
-        twai_message_t message;
-        if (espCan->readyForTraffic)
+        //hold the gate for as long as frames keep coming, lockDriver() asks us to let go
+        xSemaphoreTake(espCan->rxGate, portMAX_DELAY);
+        while (espCan->readyForTraffic && !espCan->reconfiguring)
         {
+            twai_message_t message;
             esp_err_t result;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-            result = twai_receive_v2(espCan->bus_handle, &message, pdMS_TO_TICKS(100));
+            result = twai_receive_v2(espCan->bus_handle, &message, pdMS_TO_TICKS(BI_DRIVER_POLL_MS));
 #else
-            result = twai_receive(&message, pdMS_TO_TICKS(100));
+            result = twai_receive(&message, pdMS_TO_TICKS(BI_DRIVER_POLL_MS));
 #endif
             if (result == ESP_OK)
             {
-                espCan->processFrame(message);
+                //stamp it now, before filtering and queueing add their own delay
+                espCan->processFrame(message, esp_timer_get_time());
             }
         }
-        else vTaskDelay(pdMS_TO_TICKS(100));
+        xSemaphoreGive(espCan->rxGate);
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100)); //unlockDriver() wakes us
     }
     
 }
 
+//queue record <-> CAN_FRAME. Only done at the edge of the driver, everything inside
+//works on the packed record
+static inline void recordToFrame(const ESP32_RX_RECORD &rec, CAN_FRAME &frame)
+{
+    frame.id = rec.id & ESP32_RX_ID_MASK;
+    frame.extended = (rec.id & ESP32_RX_EXTENDED) ? 1 : 0;
+    frame.rtr = (rec.id & ESP32_RX_RTR) ? 1 : 0;
+    frame.length = rec.length;
+    frame.fid = 0;
+    frame.priority = 15;
+    frame.timestamp = rec.timestamp;
+    memcpy(frame.data.bytes, rec.data, 8);
+}
+
 /*
 Issue callbacks to registered functions and objects
 Used to keep this kind of thing out of the interrupt handler
-The callback type and mailbox are passed in the fid member of the
+The callback type and mailbox travel in the mailbox / listener bytes of the
+queue record and are handed to sendCallback in the fid member of the
 CAN_FRAME struct. It isn't really used by anything.
 Layout of the storage:
 bit   31 -    If set indicates an object callback
@@ -155,6 +370,7 @@ bits  0-7   - Mailbox number that triggered callback
 void ESP32CAN::task_CAN( void *pvParameters )
 {
     ESP32CAN* espCan = (ESP32CAN*)pvParameters;
+    ESP32_RX_RECORD batch[BI_CB_BATCH];
     CAN_FRAME rxFrame;
 
     //delay a bit upon initial start up
@@ -162,19 +378,19 @@ void ESP32CAN::task_CAN( void *pvParameters )
 
     while (1)
     {
-        if (uxQueueMessagesWaiting(espCan->callbackQueue)) {
-            //receive next CAN frame from queue and fire off the callback
-            if(xQueueReceive(espCan->callbackQueue, &rxFrame, portMAX_DELAY) == pdTRUE)
-            {
-                espCan->sendCallback(&rxFrame);
-            }
-        }
-        else vTaskDelay(pdMS_TO_TICKS(4)); //if you don't delay here it will slow down the whole system. Need some delay.
+        //sleep on the queue until processFrame hands us something. Then take whatever else
+        //is already waiting so the queue has room again before the (slow) callbacks run
+        if (xQueueReceive(espCan->callbackQueue, &batch[0], portMAX_DELAY) != pdTRUE) continue;
+        int count = 1;
+        while (count < BI_CB_BATCH && xQueueReceive(espCan->callbackQueue, &batch[count], 0) == pdTRUE) count++;
 
-//probably don't need this extra delay. Test and find out.
-#if defined(CONFIG_FREERTOS_UNICORE)
-    vTaskDelay(pdMS_TO_TICKS(6)); 
-#endif
+        for (int i = 0; i < count; i++)
+        {
+            recordToFrame(batch[i], rxFrame);
+            rxFrame.fid = batch[i].mailbox;
+            if (batch[i].listener & ESP32_RX_OBJECT) rxFrame.fid |= 0x80000000ul + ((uint32_t)(batch[i].listener & 0x7F) << 24);
+            espCan->sendCallback(&rxFrame);
+        }
     }
 
     vTaskDelete(NULL);
@@ -208,11 +424,48 @@ void ESP32CAN::setRXBufferSize(int newSize)
     rxBufferSize = newSize;
 }
 
+void ESP32CAN::setCallbackQueueSize(int newSize)
+{
+    callbackQueueSize = newSize;
+}
+
+void ESP32CAN::setRXMode(ESP32_RX_MODE mode)
+{
+    rxMode = mode;
+}
+
+void ESP32CAN::setRXNotify(TaskHandle_t task)
+{
+    rxNotifyTask = task;
+}
+
 void ESP32CAN::setTXBufferSize(int newSize)
 {
     twai_general_cfg.tx_queue_len = newSize;
 }
 
+void ESP32CAN::setTXQueueSize(int newSize)
+{
+    txQueueSize = newSize;
+}
+
+uint16_t ESP32CAN::txQueueSpace()
+{
+    if (!tx_queue) return 0;
+    return uxQueueSpacesAvailable(tx_queue);
+}
+
+//frames sendFrame accepted that have neither gone out nor been counted as failed yet
+uint16_t ESP32CAN::txInFlight()
+{
+    if (!txGate) return 0;
+    xSemaphoreTake(txGate, portMAX_DELAY);
+    if (driverInstalled) accountTX();
+    uint32_t waiting = txInDriver + uxQueueMessagesWaiting(tx_queue);
+    xSemaphoreGive(txGate);
+    return (uint16_t)waiting;
+}
+
 int ESP32CAN::_setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended)
 {
     if (mailbox < BI_NUM_FILTERS)
@@ -221,6 +474,7 @@ int ESP32CAN::_setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bo
         filters[mailbox].mask = mask;
         filters[mailbox].extended = extended;
         filters[mailbox].configured = true;
+        compileFilters();
         return mailbox;
     }
     return -1;
@@ -240,6 +494,17 @@ int ESP32CAN::_setFilter(uint32_t id, uint32_t mask, bool extended)
     return -1;
 }
 
+int ESP32CAN::_clearFilter(uint8_t mailbox)
+{
+    if (mailbox < BI_NUM_FILTERS)
+    {
+        filters[mailbox].configured = false;
+        compileFilters();
+        return mailbox;
+    }
+    return -1;
+}
+
 void ESP32CAN::_init()
 {
     if (debuggingMode) Serial.println("Built in CAN Init");
@@ -250,22 +515,8 @@ void ESP32CAN::_init()
         filters[i].extended = false;
         filters[i].configured = false;
     }
+    compileFilters();
 
-    if (!CAN_WatchDog_Builtin_handler) {
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-        std::ostringstream canWatchDogTaskNameStream;
-        canWatchDogTaskNameStream << "CAN_WD_BI_CAN" << twai_general_cfg.controller_id;
-        const char *canWatchDogTaskName = canWatchDogTaskNameStream.str().c_str();
-#else
-        const char *canWatchDogTaskName = "CAN_WD_BI";
-#endif
-
-#if defined(CONFIG_FREERTOS_UNICORE)
-        xTaskCreate(&CAN_WatchDog_Builtin, canWatchDogTaskName, 2048, this, 10, &CAN_WatchDog_Builtin_handler);
-#else
-        xTaskCreatePinnedToCore(&CAN_WatchDog_Builtin, canWatchDogTaskName, 2048, this, 10, &CAN_WatchDog_Builtin_handler, 1);
-#endif
-    }
     if (debuggingMode) Serial.println("_init done");
 }
 
@@ -276,85 +527,132 @@ uint32_t ESP32CAN::init(uint32_t ul_baudrate)
     ESP_LOGD("CAN", "Init done");
     set_baudrate(ul_baudrate);
     ESP_LOGD("CAN", "Baudrate set");
-    if (debuggingMode)
-    {
-        //Reconfigure alerts to detect Error Passive and Bus-Off error states
-        uint32_t alerts_to_enable = TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF | TWAI_ALERT_AND_LOG | TWAI_ALERT_ERR_ACTIVE 
-                                  | TWAI_ALERT_ARB_LOST | TWAI_ALERT_BUS_ERROR | TWAI_ALERT_TX_FAILED | TWAI_ALERT_RX_QUEUE_FULL;
+    return ul_baudrate;
+}
 
-        esp_err_t result;
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-        result = twai_reconfigure_alerts_v2(bus_handle, alerts_to_enable, NULL);
-#else
-        result = twai_reconfigure_alerts(alerts_to_enable, NULL);
-#endif
-        if (result == ESP_OK)
+//Finds the bus speed without ever touching the bus: every candidate is tried in listen only
+//mode, so nothing is ACKed and no error frames are sent. A wrong speed shows up as bus
+//errors within a frame or two and is dropped right away, the right one as received frames.
+//Candidates that only saw silence are tried again with a longer window.
+uint32_t ESP32CAN::beginAutoSpeed()
+{
+    int order[sizeof(valid_timings) / sizeof(valid_timings[0])];
+    int numCandidates = 0;
+    uint32_t rejected = 0; //bit per entry of order[] that saw errors
+
+    _init();
+    lockDriver(); //our tasks stay out of the way while the probe drivers come and go
+    stopDriver();
+
+    for (int i = 0; autobaud_order[i] != 0; i++)
+    {
+        for (int idx = 0; valid_timings[idx].speed != 0; idx++)
         {
-            printf("Alerts reconfigured\n");
+            if (valid_timings[idx].speed == autobaud_order[i]) order[numCandidates++] = idx;
         }
-        else
+    }
+    for (int idx = 0; valid_timings[idx].speed != 0; idx++)
+    {
+        bool listed = false;
+        for (int i = 0; autobaud_order[i] != 0; i++)
         {
-            printf("Failed to reconfigure alerts");
+            if (valid_timings[idx].speed == autobaud_order[i]) listed = true;
         }
+        if (!listed) order[numCandidates++] = idx;
     }
-    //this task implements our better filtering on top of the TWAI library. Accept all frames then filter in here VVVVV
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-    std::ostringstream canLowLevelTaskNameStream;
-    canLowLevelTaskNameStream << "CAN_LORX_CAN" << twai_general_cfg.controller_id;
-    const char* canLowLevelTaskName = canLowLevelTaskNameStream.str().c_str();
-#else
-    const char* canLowLevelTaskName = "CAN_LORX_CAN0";
-#endif
 
-#if defined(CONFIG_FREERTOS_UNICORE)
-    xTaskCreate(ESP32CAN::task_LowLevelRX, canLowLevelTaskName, 4096, this, 19, NULL);
-#else
-    xTaskCreatePinnedToCore(ESP32CAN::task_LowLevelRX, canLowLevelTaskName, 4096, this, 19, NULL, 1);
-#endif
-    readyForTraffic = true;
-    return ul_baudrate;
+    for (int pass = 0; pass < BI_AUTOBAUD_PASSES; pass++)
+    {
+        uint32_t window = BI_AUTOBAUD_WINDOW_MS << (2 * pass);
+        for (int c = 0; c < numCandidates; c++)
+        {
+            if (rejected & (1ul << c)) continue;
+            int result = probeSpeed(valid_timings[order[c]].cfg, window);
+            if (result > 0)
+            {
+                uint32_t speed = valid_timings[order[c]].speed;
+                Serial.print("Auto speed found ");
+                Serial.println(speed);
+                twai_speed_cfg = valid_timings[order[c]].cfg;
+                startDriver();
+                unlockDriver();
+                return speed;
+            }
+            if (result < 0) rejected |= (1ul << c);
+        }
+    }
+    unlockDriver();
+    Serial.println("None of the tested CAN speeds worked!");
+    return 0;
 }
 
-uint32_t ESP32CAN::beginAutoSpeed()
+//Listen at one speed for up to windowMs. Returns 1 if frames were received cleanly,
+//-1 as soon as a bus error is seen (wrong speed) and 0 if the bus stayed silent.
+int ESP32CAN::probeSpeed(const twai_timing_config_t &timing, uint32_t windowMs)
 {
-    twai_general_config_t oldMode = twai_general_cfg;
+    twai_general_config_t probeCfg = twai_general_cfg;
+    twai_filter_config_t acceptAll = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+    twai_status_info_t info;
+    twai_message_t message;
+    uint32_t alerts;
+    int frames = 0;
+    int result = 0;
 
-    _init();
+    probeCfg.mode = TWAI_MODE_LISTEN_ONLY;
+    probeCfg.alerts_enabled = TWAI_ALERT_BUS_ERROR | TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    if (twai_driver_install_v2(&probeCfg, &timing, &acceptAll, &bus_handle) != ESP_OK) return 0;
+    twai_start_v2(bus_handle);
+#else
+    if (twai_driver_install(&probeCfg, &timing, &acceptAll) != ESP_OK) return 0;
+    twai_start();
+#endif
 
-    readyForTraffic = false;
-    twai_stop();
-    twai_general_cfg.mode = TWAI_MODE_LISTEN_ONLY;
-    int idx = 0;
-    while (valid_timings[idx].speed != 0)
+    uint32_t start = millis();
+    while (millis() - start < windowMs)
     {
-        twai_speed_cfg = valid_timings[idx].cfg;
-        disable();
-        Serial.print("Trying Speed ");
-        Serial.print(valid_timings[idx].speed);
-        enable();
-        delay(600); //wait a while
-        if (cyclesSinceTraffic < 2) //only would happen if there had been traffic
-        {
-            disable();
-            twai_general_cfg.mode = oldMode.mode;
-            enable();
-            Serial.println(" SUCCESS!");
-            return valid_timings[idx].speed;
-        }
-        else
+        esp_err_t rx;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+        rx = twai_receive_v2(bus_handle, &message, 1);
+        if (twai_read_alerts_v2(bus_handle, &alerts, 0) != ESP_OK) alerts = 0;
+#else
+        rx = twai_receive(&message, 1);
+        if (twai_read_alerts(&alerts, 0) != ESP_OK) alerts = 0;
+#endif
+        if (alerts)
         {
-            Serial.println(" FAILED.");
+            result = -1;
+            break;
         }
-        idx++;
+        if (rx == ESP_OK && ++frames >= 2) break; //two clean frames, no need to wait any longer
     }
-    Serial.println("None of the tested CAN speeds worked!");
+
+    if (result == 0)
+    {
+        //error counters catch anything that slipped in between the last alert read and now
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+        esp_err_t status = twai_get_status_info_v2(bus_handle, &info);
+#else
+        esp_err_t status = twai_get_status_info(&info);
+#endif
+        if (status == ESP_OK && (info.bus_error_count || info.rx_error_counter)) result = -1;
+        else if (frames > 0) result = 1;
+    }
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    twai_stop_v2(bus_handle);
+    twai_driver_uninstall_v2(bus_handle);
+#else
     twai_stop();
-    return 0;
+    twai_driver_uninstall();
+#endif
+    return result;
 }
 
 uint32_t ESP32CAN::set_baudrate(uint32_t ul_baudrate)
 {
-    disable();
+    lockDriver();
+    stopDriver();
     //now try to find a valid timing to use
     int idx = 0;
     while (valid_timings[idx].speed != 0)
@@ -362,37 +660,135 @@ uint32_t ESP32CAN::set_baudrate(uint32_t ul_baudrate)
         if (valid_timings[idx].speed == ul_baudrate)
         {
             twai_speed_cfg = valid_timings[idx].cfg;
-            enable();
+            startDriver();
+            unlockDriver();
             return ul_baudrate;
         }
         idx++;
     }
+    unlockDriver();
     printf("Could not find a valid bit timing! You will need to add your desired speed to the library!\n");
     return 0;
 }
 
+//Speed, mode and filters in one go, with the controller off the bus only while the
+//driver is reinstalled. Queues, tasks and anything still queued are left alone.
+//Filters go back to nothing accepted, just like begin().
+uint32_t ESP32CAN::reconfigure(uint32_t ul_baudrate, bool listenOnly)
+{
+    int idx = 0;
+    while (valid_timings[idx].speed != 0 && valid_timings[idx].speed != ul_baudrate) idx++;
+    if (valid_timings[idx].speed == 0)
+    {
+        printf("Could not find a valid bit timing! You will need to add your desired speed to the library!\n");
+        return 0;
+    }
+
+    lockDriver();
+    uint64_t darkStart = esp_timer_get_time();
+    stopDriver();
+    _init(); //no frames are being filtered while the lookup tables are rebuilt
+    twai_filters_cfg = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+    twai_speed_cfg = valid_timings[idx].cfg;
+    twai_general_cfg.mode = listenOnly ? TWAI_MODE_LISTEN_ONLY : TWAI_MODE_NORMAL;
+    startDriver();
+    uint32_t dark = (uint32_t)(esp_timer_get_time() - darkStart);
+    unlockDriver();
+    if (debuggingMode) printf("Reconfigured to %u, off the bus for %u us\n", (unsigned)ul_baudrate, (unsigned)dark);
+    return ul_baudrate;
+}
+
 void ESP32CAN::setListenOnlyMode(bool state)
 {
-    disable();
+    lockDriver();
+    stopDriver();
     twai_general_cfg.mode = state?TWAI_MODE_LISTEN_ONLY:TWAI_MODE_NORMAL;
-    enable();
+    startDriver();
+    unlockDriver();
 }
 
 void ESP32CAN::setNoACKMode(bool state)
 {
-    disable();
+    lockDriver();
+    stopDriver();
     twai_general_cfg.mode = state?TWAI_MODE_NO_ACK:TWAI_MODE_NORMAL;
-    enable();
+    startDriver();
+    unlockDriver();
 }
 
-void ESP32CAN::enable()
+//Queues and tasks are made once, the first time they're needed, and live on through any
+//number of disable() / enable() and reconfigurations.
+void ESP32CAN::createTasks()
+{
+    if (rxGate) return;
+
+    printf("Creating queues\n");
+    callbackQueue = xQueueCreate(callbackQueueSize, sizeof(ESP32_RX_RECORD));
+    if (rxMode == ESP32_RX_RING) rxRing.allocate(rxBufferSize);
+    else rx_queue = xQueueCreate(rxBufferSize, sizeof(ESP32_RX_RECORD));
+    eventQueue = xQueueCreate(BI_EVENT_QUEUE_SIZE, sizeof(ESP32_ERROR_EVENT));
+    tx_queue = xQueueCreate(txQueueSize, sizeof(twai_message_t));
+    rxGate = xSemaphoreCreateMutex();
+    alertGate = xSemaphoreCreateMutex();
+    txGate = xSemaphoreCreateMutex();
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    snprintf(taskNameCAN, sizeof(taskNameCAN), "CAN_RX_CAN%d", twai_general_cfg.controller_id);
+    snprintf(taskNameRX, sizeof(taskNameRX), "CAN_LORX_CAN%d", twai_general_cfg.controller_id);
+    snprintf(taskNameWD, sizeof(taskNameWD), "CAN_WD_BI_CAN%d", twai_general_cfg.controller_id);
+#else
+    strcpy(taskNameCAN, "CAN_RX_CAN");
+    strcpy(taskNameRX, "CAN_LORX_CAN");
+    strcpy(taskNameWD, "CAN_WD_BI");
+#endif
+
+    printf("Starting can handler task\n");
+    xTaskCreate(ESP32CAN::task_CAN, taskNameCAN, 8192, this, 15, &task_CAN_handler);
+
+#if defined(CONFIG_FREERTOS_UNICORE)
+    printf("Starting low level RX task\n");
+    xTaskCreate(ESP32CAN::task_LowLevelRX, taskNameRX, 4096, this, 19, &task_LowLevelRX_handler);
+    xTaskCreate(&CAN_WatchDog_Builtin, taskNameWD, 2048, this, 10, &CAN_WatchDog_Builtin_handler);
+#else
+    //this next task implements our better filtering on top of the TWAI library. Accept all frames then filter in here VVVVV
+    xTaskCreatePinnedToCore(&task_LowLevelRX, taskNameRX, 4096, this, 19, &task_LowLevelRX_handler, 1);
+    xTaskCreatePinnedToCore(&CAN_WatchDog_Builtin, taskNameWD, 2048, this, 10, &CAN_WatchDog_Builtin_handler, 1);
+#endif
+}
+
+//Get the RX and alert tasks out of the driver and keep them out until unlockDriver().
+//Waits at most BI_DRIVER_POLL_MS for each of them. Senders wait here too.
+void ESP32CAN::lockDriver()
+{
+    createTasks();
+    reconfiguring = true;
+    xSemaphoreTake(rxGate, portMAX_DELAY);
+    xSemaphoreTake(alertGate, portMAX_DELAY);
+    xSemaphoreTake(txGate, portMAX_DELAY);
+}
+
+void ESP32CAN::unlockDriver()
+{
+    reconfiguring = false;
+    xSemaphoreGive(txGate);
+    xSemaphoreGive(alertGate);
+    xSemaphoreGive(rxGate);
+    if (task_LowLevelRX_handler) xTaskNotifyGive(task_LowLevelRX_handler);
+    if (CAN_WatchDog_Builtin_handler) xTaskNotifyGive(CAN_WatchDog_Builtin_handler);
+}
+
+//Install and start the TWAI driver with the current settings. Only call with the driver locked.
+bool ESP32CAN::startDriver()
 {
+    twai_general_cfg.alerts_enabled = BI_ALERTS;
+    if (debuggingMode) twai_general_cfg.alerts_enabled |= TWAI_ALERT_AND_LOG;
+
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
     if (twai_driver_install_v2(&twai_general_cfg, &twai_speed_cfg, &twai_filters_cfg, &bus_handle) == ESP_OK) {
         printf("Driver installed - bus %d\n", twai_general_cfg.controller_id);
     } else {
         printf("Failed to install driver - bus %d\n", twai_general_cfg.controller_id);
-        return;
+        return false;
     }
 #else
     if (twai_driver_install(&twai_general_cfg, &twai_speed_cfg, &twai_filters_cfg) == ESP_OK)
@@ -402,37 +798,15 @@ void ESP32CAN::enable()
     else
     {
         printf("Failed to install TWAI driver\n");
-        return;
+        return false;
     }
 #endif
-
-    printf("Creating queues\n");
-
-    callbackQueue = xQueueCreate(16, sizeof(CAN_FRAME));
-    rx_queue = xQueueCreate(rxBufferSize, sizeof(CAN_FRAME));
-
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-    std::ostringstream canHandlerTaskNameStream;
-    std::ostringstream canLowLevelTaskNameStream;
-    canHandlerTaskNameStream << "CAN_RX_CAN" << twai_general_cfg.controller_id;
-    canLowLevelTaskNameStream << "CAN_LORX_CAN" << twai_general_cfg.controller_id;
-    const char* canHandlerTaskName = canHandlerTaskNameStream.str().c_str();
-    const char* canLowLevelTaskName = canLowLevelTaskNameStream.str().c_str();
-#else
-    const char* canHandlerTaskName = "CAN_RX_CAN";
-    const char* canLowLevelTaskName = "CAN_LORX_CAN";
-#endif
-
-    printf("Starting can handler task\n");
-    xTaskCreate(ESP32CAN::task_CAN, canHandlerTaskName, 8192, this, 15, &task_CAN_handler);
-
-#if defined(CONFIG_FREERTOS_UNICORE)
-    printf("Starting low level RX task\n");
-    xTaskCreate(ESP32CAN::task_LowLevelRX, canLowLevelTaskName, 4096, this, 19, &task_LowLevelRX_handler);
-#else
-    //this next task implements our better filtering on top of the TWAI library. Accept all frames then filter in here VVVVV
-    xTaskCreatePinnedToCore(&task_LowLevelRX, canLowLevelTaskName, 4096, this, 19, &task_LowLevelRX_handler, 1);
-#endif
+    driverInstalled = true;
+    installedFilter = twai_filters_cfg;
+    twaiMissedBase = 0; //a freshly installed driver starts its loss counters at zero
+    twaiOverrunBase = 0;
+    txInDriver = 0;
+    txFailedSeen = 0;
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
     //Start TWAI driver
@@ -440,7 +814,7 @@ void ESP32CAN::enable()
         printf("Driver started - bus %d\n", twai_general_cfg.controller_id);
     } else {
         printf("Failed to start driver\n");
-        return;
+        return false;
     }
 #else
     // Start TWAI driver
@@ -451,106 +825,320 @@ void ESP32CAN::enable()
     else
     {
         printf("Failed to start TWAI driver\n");
-        return;
+        return false;
     }
 #endif
 
     readyForTraffic = true;
+    return true;
 }
 
-void ESP32CAN::disable()
+//Stop and remove the TWAI driver if it is installed. Only call with the driver locked.
+void ESP32CAN::stopDriver()
 {
+    readyForTraffic = false;
+    if (!driverInstalled) return;
+    //whatever the driver still holds goes down with it, parked frames wait for the next start
+    accountTX();
+    driverStats.txFailed += txInDriver;
+    txInDriver = 0;
+    //the TWAI loss counters go away with the driver, keep what they counted since the last
+    //reset. Read once it has stopped so nothing can be lost in between.
     twai_status_info_t info;
-    if (twai_get_status_info(&info) == ESP_OK) {
-        if (info.state == TWAI_STATE_RUNNING) {
-            twai_stop();
+    esp_err_t result;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    twai_stop_v2(bus_handle);
+    result = twai_get_status_info_v2(bus_handle, &info);
+#else
+    twai_stop();
+    result = twai_get_status_info(&info);
+#endif
+    if (result == ESP_OK)
+    {
+        if (info.rx_missed_count >= twaiMissedBase) driverStats.twaiQueueMissed += info.rx_missed_count - twaiMissedBase;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+        if (info.rx_overrun_count >= twaiOverrunBase) driverStats.twaiFifoOverruns += info.rx_overrun_count - twaiOverrunBase;
+#endif
+    }
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    twai_driver_uninstall_v2(bus_handle);
+    bus_handle = nullptr; //freed with the driver
+#else
+    twai_driver_uninstall();
+#endif
+    driverInstalled = false;
+}
+
+void ESP32CAN::enable()
+{
+    lockDriver();
+    if (!driverInstalled) startDriver();
+    unlockDriver();
+}
+
+void ESP32CAN::disable()
+{
+    if (!rxGate) return; //never enabled, nothing to stop
+    lockDriver();
+    stopDriver();
+    unlockDriver();
+}
+
+//This function is too big to be running in interrupt context. Refactored so it doesn't.
+//Rebuild the lookup structures used by findFilter. Called whenever filters[] changes.
+//Lower numbered filters win, just like the old linear scan. The RX task keeps filtering
+//with the current set while the other one is built, then the new set is swapped in.
+void ESP32CAN::compileFilters()
+{
+    ESP32_FILTER_TABLES *tables = (activeTables == &filterTables[0]) ? &filterTables[1] : &filterTables[0];
+    //findFilter may still be in this set if it picked it up just before the previous swap
+    while (__atomic_load_n(&readingTables, __ATOMIC_SEQ_CST) == tables) vTaskDelay(1);
+
+    uint8_t *stdFilterMap = tables->stdFilterMap;
+    ESP32_EXT_GROUP *extFilterGroups = tables->extFilterGroups;
+    ESP32_EXT_ENTRY *extFilterEntries = tables->extFilterEntries;
+
+    //standard IDs: walk the filters from the highest number down so lower ones overwrite
+    memset(stdFilterMap, 0, sizeof(tables->stdFilterMap));
+    for (int i = BI_NUM_FILTERS - 1; i >= 0; i--)
+    {
+        if (!filters[i].configured || filters[i].extended) continue;
+        for (uint32_t id = 0; id < 2048; id++)
+        {
+            if ((id & filters[i].mask) == filters[i].id) stdFilterMap[id] = i + 1;
         }
+    }
+
+    //extended IDs: group by mask, sort each group by id
+    int groups = 0;
+    int entries = 0;
+    for (int i = 0; i < BI_NUM_FILTERS; i++)
+    {
+        if (!filters[i].configured || !filters[i].extended) continue;
+        bool seen = false;
+        for (int g = 0; g < groups; g++)
+            if (extFilterGroups[g].mask == filters[i].mask) seen = true;
+        if (seen) continue;
 
-        for (auto task : {task_CAN_handler, task_LowLevelRX_handler}) {
-            if (task != NULL)
+        ESP32_EXT_GROUP &group = extFilterGroups[groups++];
+        group.mask = filters[i].mask;
+        group.first = entries;
+        group.count = 0;
+        for (int j = i; j < BI_NUM_FILTERS; j++)
+        {
+            if (!filters[j].configured || !filters[j].extended || filters[j].mask != group.mask) continue;
+            //insertion sort by id, a duplicate id keeps the lower filter number (found first)
+            int pos = group.first + group.count;
+            bool duplicate = false;
+            for (int k = group.first; k < group.first + group.count; k++)
+                if (extFilterEntries[k].id == filters[j].id) duplicate = true;
+            if (duplicate) continue;
+            while (pos > group.first && extFilterEntries[pos - 1].id > filters[j].id)
             {
-                vTaskDelete(task);
-                task = NULL;
+                extFilterEntries[pos] = extFilterEntries[pos - 1];
+                pos--;
             }
+            extFilterEntries[pos].id = filters[j].id;
+            extFilterEntries[pos].filter = j;
+            group.count++;
+            entries++;
         }
+    }
+    tables->numExtFilterGroups = groups;
+    __atomic_store_n(&activeTables, tables, __ATOMIC_SEQ_CST);
 
-        for (auto queue : {rx_queue, callbackQueue}) {
-            if (queue) {
-                vQueueDelete(queue);
-            }
+    updateHardwareFilter();
+}
+
+//Narrow the TWAI acceptance filter (single filter mode) to the smallest code / mask that still
+//passes everything filters[] accepts, so the controller drops unwanted frames before they wake
+//the RX task. processFrame keeps filtering the residue in software. In single filter mode the
+//same code is matched against standard frames as ID[10:0] in bits 31-21 and against extended
+//frames as ID[28:0] in bits 31-3, so when both kinds are in use the two hulls are merged.
+void ESP32CAN::updateHardwareFilter()
+{
+    uint32_t code = 0, mask = 0; //mask bit set = don't care (TWAI convention)
+    bool any = false;
+    bool acceptAll = true;
+
+    for (int i = 0; i < BI_NUM_FILTERS; i++)
+    {
+        if (!filters[i].configured) continue;
+        uint32_t fCode, fMask;
+        if (filters[i].extended)
+        {
+            fCode = (filters[i].id & 0x1FFFFFFF) << 3;
+            fMask = (~(filters[i].mask << 3) & 0xFFFFFFF8ul) | 0x7; //RTR and unused bits
         }
+        else
+        {
+            fCode = (filters[i].id & 0x7FF) << 21;
+            fMask = (~(filters[i].mask << 21) & 0xFFE00000ul) | 0x1FFFFF; //RTR and data bytes
+        }
+        if (!any)
+        {
+            code = fCode;
+            mask = fMask;
+            any = true;
+        }
+        else
+        {
+            mask |= fMask | (code ^ fCode);
+        }
+        code &= ~mask;
+        acceptAll = false;
+        if (mask == 0xFFFFFFFFul) break;
+    }
 
-        twai_driver_uninstall();
-    } else {
-        return;
+    twai_filter_config_t newFilter;
+    newFilter.single_filter = true;
+    if (acceptAll || mask == 0xFFFFFFFFul)
+    {
+        newFilter.acceptance_code = 0;
+        newFilter.acceptance_mask = 0xFFFFFFFFul;
     }
-    readyForTraffic = false;
+    else
+    {
+        newFilter.acceptance_code = code;
+        newFilter.acceptance_mask = mask;
+    }
+
+    //the filter can only be changed by reinstalling the driver, which takes the controller off
+    //the bus. So it is only stored here and goes in with the next start or applyFilters(),
+    //once for a whole batch of filter changes.
+    twai_filters_cfg = newFilter;
 }
 
-//This function is too big to be running in interrupt context. Refactored so it doesn't.
-bool ESP32CAN::processFrame(twai_message_t &frame)
+//Bring the hardware filter in line with filters[] after a batch of watchFor / setRXFilter
+//calls. Does nothing (and never touches the bus) if it is already what the driver runs with.
+void ESP32CAN::applyFilters()
+{
+    if (!readyForTraffic) return; //the next start installs it anyway
+    if (twai_filters_cfg.acceptance_code == installedFilter.acceptance_code &&
+        twai_filters_cfg.acceptance_mask == installedFilter.acceptance_mask &&
+        twai_filters_cfg.single_filter == installedFilter.single_filter) return;
+
+    if (debuggingMode) printf("Hardware filter code %08X mask %08X\n", (unsigned)twai_filters_cfg.acceptance_code,
+                              (unsigned)twai_filters_cfg.acceptance_mask);
+    lockDriver();
+    stopDriver();
+    startDriver();
+    unlockDriver();
+}
+
+//Number of the lowest filter accepting this frame or -1. Constant time for standard IDs,
+//one binary search per distinct extended mask otherwise.
+int ESP32CAN::findFilter(uint32_t id, bool extended)
+{
+    //claim the current set, and make sure it was not swapped out before the claim was seen
+    ESP32_FILTER_TABLES *tables;
+    do
+    {
+        tables = __atomic_load_n(&activeTables, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&readingTables, tables, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&activeTables, __ATOMIC_SEQ_CST) != tables);
+
+    int best = -1;
+    if (!extended)
+    {
+        if (id < 2048) best = (int)tables->stdFilterMap[id] - 1;
+    }
+    else
+    {
+        const ESP32_EXT_ENTRY *entries = tables->extFilterEntries;
+        for (int g = 0; g < tables->numExtFilterGroups; g++)
+        {
+            const ESP32_EXT_GROUP &group = tables->extFilterGroups[g];
+            uint32_t key = id & group.mask;
+            int lo = group.first;
+            int hi = lo + group.count - 1;
+            while (lo <= hi)
+            {
+                int mid = (lo + hi) >> 1;
+                if (entries[mid].id == key)
+                {
+                    if (best < 0 || entries[mid].filter < best) best = entries[mid].filter;
+                    break;
+                }
+                if (entries[mid].id < key) lo = mid + 1;
+                else hi = mid - 1;
+            }
+        }
+    }
+    __atomic_store_n(&readingTables, (ESP32_FILTER_TABLES *)NULL, __ATOMIC_RELEASE);
+    return best;
+}
+
+bool ESP32CAN::processFrame(twai_message_t &frame, uint64_t stamp)
 {
     CANListener *thisListener;
-    CAN_FRAME msg;
+    ESP32_RX_RECORD rec;
 
     cyclesSinceTraffic = 0; //reset counter to show that we are receiving traffic
 
-    msg.id = frame.identifier;
-    msg.length = frame.data_length_code;
-    msg.rtr = frame.rtr;
-    msg.extended = frame.extd;
-    for (int i = 0; i < 8; i++) msg.data.byte[i] = frame.data[i];
+    rec.id = frame.identifier & ESP32_RX_ID_MASK;
+    if (frame.extd) rec.id |= ESP32_RX_EXTENDED;
+    if (frame.rtr) rec.id |= ESP32_RX_RTR;
+    rec.timestamp = (uint32_t)stamp;
+    rec.length = frame.data_length_code;
+    rec.mailbox = 0xFF;
+    rec.listener = 0;
+    rec.reserved = 0;
+    memcpy(rec.data, frame.data, 8);
     
-    for (int i = 0; i < BI_NUM_FILTERS; i++)
+    int i = findFilter(frame.identifier, frame.extd);
+    if (i >= 0)
     {
-        if (!filters[i].configured) continue;
-        if ((msg.id & filters[i].mask) == filters[i].id && (filters[i].extended == msg.extended))
+        //frame is accepted, lets see if it matches a mailbox callback
+        if (cbCANFrame[i])
         {
-            //frame is accepted, lets see if it matches a mailbox callback
-            if (cbCANFrame[i])
-            {
-                msg.fid = i;
-                xQueueSend(callbackQueue, &msg, 0);
-                return true;
-            }
-            else if (cbGeneral)
-            {
-                msg.fid = 0xFF;
-                xQueueSend(callbackQueue, &msg, 0);
-                return true;
-            }
-            else
+            rec.mailbox = i;
+            pushCallback(rec);
+            return true;
+        }
+        else if (cbGeneral)
+        {
+            pushCallback(rec);
+            return true;
+        }
+        else
+        {
+            for (int listenerPos = 0; listenerPos < SIZE_LISTENERS; listenerPos++)
             {
-                for (int listenerPos = 0; listenerPos < SIZE_LISTENERS; listenerPos++)
+                thisListener = listener[listenerPos];
+                if (thisListener != NULL)
                 {
-                    thisListener = listener[listenerPos];
-                    if (thisListener != NULL)
+                    if (thisListener->isCallbackActive(i)) 
+                    {
+                        rec.mailbox = i;
+                        rec.listener = ESP32_RX_OBJECT | listenerPos;
+                        pushCallback(rec);
+                        return true;
+                    }
+                    else if (thisListener->isCallbackActive(numFilters)) //global catch-all 
                     {
-                        if (thisListener->isCallbackActive(i)) 
-				        {
-					        msg.fid = 0x80000000ul + (listenerPos << 24ul) + i;
-                            xQueueSend(callbackQueue, &msg, 0);
-                            return true;
-				        }
-				        else if (thisListener->isCallbackActive(numFilters)) //global catch-all 
-				        {
-                            msg.fid = 0x80000000ul + (listenerPos << 24ul) + 0xFF;
-					        xQueueSend(callbackQueue, &msg, 0);
-                            return true;
-				        }
+                        rec.listener = ESP32_RX_OBJECT | listenerPos;
+                        pushCallback(rec);
+                        return true;
                     }
                 }
             }
-            
-            //otherwise, send frame to input queue
-            xQueueSend(rx_queue, &msg, 0);
-            if (debuggingMode) Serial.write('_');
-            return true;
         }
+        
+        //otherwise, send frame to input queue
+        pushRX(rec);
+        if (debuggingMode) Serial.write('_');
+        return true;
     }
     return false;
 }
 
+//Never waits, neither for the bus nor for txGate. The frame goes straight into the driver tx
+//queue if nothing is parked, otherwise (or if the driver is full, or txGate is taken because
+//the driver is being reinstalled or probed) it is parked in tx_queue and the watchdog task
+//feeds it to the driver on its next pass. True = the frame is queued for transmission,
+//false = it was dropped (driver down, listen only, bus off or tx_queue full).
+//getDriverStats() says what became of the queued frames.
 bool ESP32CAN::sendFrame(CAN_FRAME& txFrame)
 {
     twai_message_t __TX_frame;
@@ -561,58 +1149,239 @@ bool ESP32CAN::sendFrame(CAN_FRAME& txFrame)
     __TX_frame.extd = txFrame.extended;
     for (int i = 0; i < 8; i++) __TX_frame.data[i] = txFrame.data.byte[i];
 
-    //don't wait long if the queue was full. The end user code shouldn't be sending faster
-    //than the buffer can empty. Set a bigger TX buffer or delay sending if this is a problem.
-    esp_err_t result;
+    if (!txGate) return false; //never enabled
+    if (xSemaphoreTake(txGate, 0) != pdTRUE)
+    {
+        //held for a whole reinstall or beginAutoSpeed probe by lockDriver(), otherwise just
+        //for a moment. Park the frame instead of waiting. Safe without txGate, pumpTX only
+        //ever takes from the front. driverStats needs the gate, so count a refusal aside.
+        if (xQueueSend(tx_queue, &__TX_frame, 0) == pdTRUE) return true;
+        __atomic_fetch_add(&txQueueFullUngated, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    esp_err_t result = ESP_ERR_INVALID_STATE;
+    bool queued = false;
+    if (driverInstalled)
+    {
+        //parked frames go first, otherwise this one would overtake them
+        if (uxQueueMessagesWaiting(tx_queue) == 0) result = transmit(__TX_frame);
+        else result = ESP_ERR_TIMEOUT;
+
+        if (result == ESP_OK)
+        {
+            txInDriver++;
+            queued = true;
+        }
+        else if (result == ESP_ERR_TIMEOUT)
+        {
+            if (xQueueSend(tx_queue, &__TX_frame, 0) == pdTRUE)
+            {
+                uint16_t waiting = uxQueueMessagesWaiting(tx_queue);
+                if (waiting > driverStats.txHighWater) driverStats.txHighWater = waiting;
+                queued = true;
+            }
+            else driverStats.txQueueFull++;
+        }
+    }
+    if (!queued && result != ESP_ERR_TIMEOUT) driverStats.txFailed++;
+    xSemaphoreGive(txGate);
+
+    if (debuggingMode)
+    {
+        if (result == ESP_OK) Serial.write('<');
+        else if (queued) Serial.write('T');
+        else Serial.write('!');
+    }
+    return queued;
+}
+
+//hand a frame to the reader. In ring mode this is the only place the ring is pushed.
+bool ESP32CAN::pushRX(const ESP32_RX_RECORD &rec)
+{
+    if (rxMode != ESP32_RX_RING)
+    {
+        if (!rx_queue) return false;
+        if (xQueueSend(rx_queue, &rec, 0) != pdTRUE)
+        {
+            driverStats.rxQueueFull++;
+            return false;
+        }
+        uint16_t waiting = uxQueueMessagesWaiting(rx_queue);
+        if (waiting > driverStats.rxHighWater) driverStats.rxHighWater = waiting;
+        return true;
+    }
+
+    uint32_t waiting;
+    if (!rxRing.allocated()) return false;
+    if (!rxRing.push(rec, waiting)) //full, drop the frame like a full queue would
+    {
+        driverStats.rxQueueFull++;
+        return false;
+    }
+    if (waiting > driverStats.rxHighWater) driverStats.rxHighWater = waiting;
+
+    //only wake the reader on the empty -> not empty edge
+    if (rxNotifyTask && rxRing.readerCaughtUp()) xTaskNotifyGive(rxNotifyTask);
+    return true;
+}
+
+//queue a frame for task_CAN to fire the callbacks
+bool ESP32CAN::pushCallback(const ESP32_RX_RECORD &rec)
+{
+    if (xQueueSend(callbackQueue, &rec, 0) != pdTRUE)
+    {
+        driverStats.callbackQueueFull++;
+        return false;
+    }
+    uint16_t waiting = uxQueueMessagesWaiting(callbackQueue);
+    if (waiting > driverStats.callbackHighWater) driverStats.callbackHighWater = waiting;
+    return true;
+}
+
+//take the oldest frame. In ring mode this is the only place the ring is popped.
+bool ESP32CAN::popRX(ESP32_RX_RECORD &rec)
+{
+    if (rxMode != ESP32_RX_RING)
+    {
+        if (!rx_queue) return false;
+        return xQueueReceive(rx_queue, &rec, 0) == pdTRUE;
+    }
+
+    return rxRing.pop(rec);
+}
+
+uint16_t ESP32CAN::rxWaiting()
+{
+    if (rxMode != ESP32_RX_RING)
+    {
+        if (!rx_queue) return 0;
+        return uxQueueMessagesWaiting(rx_queue);
+    }
+    return (uint16_t)rxRing.waiting();
+}
+
+//our own counters plus the TWAI driver's loss counters since the last reset. Losses of
+//drivers installed before the current one were added to driverStats by stopDriver.
+//The driver is only asked while it is installed, and txGate keeps it from going away
+//in the middle (the handle is freed with it).
+void ESP32CAN::getDriverStats(ESP32_DRIVER_STATS &stats)
+{
+    twai_status_info_t info;
+    esp_err_t result = ESP_FAIL;
+
+    if (txGate) xSemaphoreTake(txGate, portMAX_DELAY);
+    stats = driverStats;
+    stats.txQueueFull += __atomic_load_n(&txQueueFullUngated, __ATOMIC_RELAXED);
+    if (driverInstalled)
+    {
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-    result = twai_transmit_v2(bus_handle, &__TX_frame, pdMS_TO_TICKS(4));
+        result = twai_get_status_info_v2(bus_handle, &info);
 #else
-    result = twai_transmit(&__TX_frame, pdMS_TO_TICKS(4));
+        result = twai_get_status_info(&info);
 #endif
-    switch (result)
-    {
-    case ESP_OK:
-        if (debuggingMode) Serial.write('<');
-        break;
-    case ESP_ERR_TIMEOUT:
-        if (debuggingMode) Serial.write('T');
-        break;
-    case ESP_ERR_INVALID_ARG:
-    case ESP_FAIL:
-    case ESP_ERR_INVALID_STATE:
-    case ESP_ERR_NOT_SUPPORTED:
-        if (debuggingMode) Serial.write('!');
-        break;
     }
-    
-    return true;
+    if (result == ESP_OK)
+    {
+        //the driver counters restart when it is reinstalled, don't let that go negative
+        stats.twaiQueueMissed += (info.rx_missed_count >= twaiMissedBase) ? info.rx_missed_count - twaiMissedBase : info.rx_missed_count;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+        stats.twaiFifoOverruns += (info.rx_overrun_count >= twaiOverrunBase) ? info.rx_overrun_count - twaiOverrunBase : info.rx_overrun_count;
+#endif
+    }
+    if (txGate) xSemaphoreGive(txGate);
+}
+
+void ESP32CAN::resetDriverStats()
+{
+    twai_status_info_t info;
+    esp_err_t result = ESP_FAIL;
+
+    if (txGate) xSemaphoreTake(txGate, portMAX_DELAY);
+    memset(&driverStats, 0, sizeof(driverStats));
+    __atomic_store_n(&txQueueFullUngated, 0, __ATOMIC_RELAXED);
+    twaiMissedBase = 0;
+    twaiOverrunBase = 0;
+    if (driverInstalled)
+    {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+        result = twai_get_status_info_v2(bus_handle, &info);
+#else
+        result = twai_get_status_info(&info);
+#endif
+    }
+    if (result == ESP_OK)
+    {
+        twaiMissedBase = info.rx_missed_count;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+        twaiOverrunBase = info.rx_overrun_count;
+#endif
+    }
+    if (txGate) xSemaphoreGive(txGate);
 }
 
 bool ESP32CAN::rx_avail()
 {
-    if (!rx_queue) return false;
-    return uxQueueMessagesWaiting(rx_queue) > 0?true:false;
+    return rxWaiting() > 0?true:false;
 }
 
 uint16_t ESP32CAN::available()
 {
-    if (!rx_queue) return 0;
-    return uxQueueMessagesWaiting(rx_queue);
+    return rxWaiting();
 }
 
 uint32_t ESP32CAN::get_rx_buff(CAN_FRAME &msg)
 {
-    CAN_FRAME frame;
+    ESP32_RX_RECORD rec;
     //receive next CAN frame from queue
-    if (uxQueueMessagesWaiting(rx_queue)) {
-        if(xQueueReceive(rx_queue, &frame, 0) == pdTRUE)
-        {
-            msg = frame; //do a copy in the case that the receive worked
-            return true;
-        }
-        else
-            return false;
+    if (popRX(rec))
+    {
+        recordToFrame(rec, msg); //only touch msg in the case that the receive worked
+        return true;
     }
     return false; //otherwise we leave the msg variable alone and just return false
 }
 
+//the TWAI controller is classic CAN only, FD reads just hand out classic frames
+uint32_t ESP32CAN::get_rx_buffFD(CAN_FRAME_FD &msg)
+{
+    CAN_FRAME frame;
+    if (!get_rx_buff(frame)) return false;
+    return canToFD(frame, msg);
+}
+
+//unpack straight into the caller's array. No waiting check per frame, an empty queue
+//or ring simply ends the loop.
+size_t ESP32CAN::readBatch(CAN_FRAME *out, size_t max)
+{
+    ESP32_RX_RECORD rec;
+    size_t count = 0;
+    while (count < max && popRX(rec))
+    {
+        recordToFrame(rec, out[count]);
+        count++;
+    }
+    return count;
+}
+
+size_t ESP32CAN::readBatchFD(CAN_FRAME_FD *out, size_t max)
+{
+    ESP32_RX_RECORD rec;
+    size_t count = 0;
+    while (count < max && popRX(rec))
+    {
+        CAN_FRAME_FD &dest = out[count];
+        dest.id = rec.id & ESP32_RX_ID_MASK;
+        dest.extended = (rec.id & ESP32_RX_EXTENDED) ? 1 : 0;
+        dest.rrs = (rec.id & ESP32_RX_RTR) ? 1 : 0;
+        dest.fdMode = false;
+        dest.length = rec.length;
+        dest.fid = 0;
+        dest.priority = 15;
+        dest.timestamp = rec.timestamp;
+        memcpy(dest.data.uint8, rec.data, 8);
+        count++;
+    }
+    return count;
+}
+
@@ -36,19 +36,49 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/gpio.h"
 #include "driver/adc.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_adc_cal.h"
 #include "driver/twai.h"
 #include <string.h>
-#include <sstream>
+#include "esp32_rx_ring.h"
 
 //#define DEBUG_SETUP
 #define BI_NUM_FILTERS 32
 
-#define BI_RX_BUFFER_SIZE	64
-#define BI_TX_BUFFER_SIZE  16
+#define BI_RX_BUFFER_SIZE	256
+#define BI_TX_BUFFER_SIZE  16 //TWAI driver tx queue
+#define BI_TX_QUEUE_SIZE   64 //frames waiting in front of it, see setTXQueueSize()
+#define BI_CB_QUEUE_SIZE   32
+#define BI_CB_BATCH        8  //callbacks fired per wake up of task_CAN
+#define BI_EVENT_QUEUE_SIZE 16 //error events waiting for getErrorEvent()
+#define BI_DRIVER_POLL_MS  10 //longest the RX / alert tasks stay inside one driver call, bounds how long a reconfigure waits
+
+//beginAutoSpeed: listen window per candidate in the first pass, each later pass waits 4x longer
+#define BI_AUTOBAUD_WINDOW_MS 20
+#define BI_AUTOBAUD_PASSES    3
+
+//alerts the watchdog task sleeps on. The TX ones only wake it to refill the driver tx queue.
+#define BI_TX_ALERTS (TWAI_ALERT_TX_IDLE | TWAI_ALERT_TX_SUCCESS | TWAI_ALERT_TX_FAILED)
+#ifdef TWAI_ALERT_RX_FIFO_OVERRUN
+#define BI_ALERTS (TWAI_ALERT_BUS_ERROR | TWAI_ALERT_ERR_PASS | TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_BUS_OFF | TWAI_ALERT_BUS_RECOVERED \
+                   | TWAI_ALERT_ARB_LOST | TWAI_ALERT_RX_QUEUE_FULL | TWAI_ALERT_RX_FIFO_OVERRUN | BI_TX_ALERTS)
+#else
+#define BI_ALERTS (TWAI_ALERT_BUS_ERROR | TWAI_ALERT_ERR_PASS | TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_BUS_OFF | TWAI_ALERT_BUS_RECOVERED \
+                   | TWAI_ALERT_ARB_LOST | TWAI_ALERT_RX_QUEUE_FULL | BI_TX_ALERTS)
+#endif
+
+//error event types
+#define ESP32_EVENT_BUS_ERROR     1
+#define ESP32_EVENT_ERROR_PASSIVE 2
+#define ESP32_EVENT_BUS_OFF       3
+#define ESP32_EVENT_RECOVERED     4
+#define ESP32_EVENT_RX_OVERRUN    5
+#define ESP32_EVENT_ERROR_ACTIVE  6
+#define ESP32_EVENT_ARB_LOST      7
 
 typedef struct
 {
@@ -58,6 +88,81 @@ typedef struct
   bool configured;
 } ESP32_FILTER;
 
+//extended filters compiled by compileFilters(): one group per distinct mask, each group
+//is a run of entries in extFilterEntries sorted by id so it can be binary searched
+typedef struct
+{
+  uint32_t mask;
+  uint8_t first; //index of the first entry of the group
+  uint8_t count;
+} ESP32_EXT_GROUP;
+
+typedef struct
+{
+  uint32_t id;    //id & mask
+  uint8_t filter; //lowest numbered filter with this id / mask
+} ESP32_EXT_ENTRY;
+
+//one complete set of lookup tables. compileFilters fills the one not in use and then
+//publishes it, so findFilter never sees a half built set.
+typedef struct
+{
+  uint8_t stdFilterMap[2048]; //first filter accepting this standard ID + 1, 0 = rejected
+  ESP32_EXT_GROUP extFilterGroups[BI_NUM_FILTERS];
+  ESP32_EXT_ENTRY extFilterEntries[BI_NUM_FILTERS];
+  int numExtFilterGroups;
+} ESP32_FILTER_TABLES;
+
+//what actually sits in rx_queue and callbackQueue. 20 bytes instead of the 24 of a
+//CAN_FRAME, it is only turned into a CAN_FRAME when it leaves the driver
+typedef struct
+{
+  uint32_t id;        //bit 31 = extended, bit 30 = rtr, 29 bit id below
+  uint32_t timestamp; //esp_timer time the frame came out of twai_receive, low 32 bits (same clock as micros())
+  uint8_t data[8];
+  uint8_t length;
+  uint8_t mailbox;  //filter that triggered the callback, 0xFF = general / catch-all
+  uint8_t listener; //bit 7 set = object callback, bits 0-6 = index into the listener table
+  uint8_t reserved;
+} __attribute__((packed)) ESP32_RX_RECORD;
+
+#define ESP32_RX_EXTENDED 0x80000000ul
+#define ESP32_RX_RTR      0x40000000ul
+#define ESP32_RX_ID_MASK  0x1FFFFFFFul
+#define ESP32_RX_OBJECT   0x80
+
+//how received frames are handed from task_LowLevelRX to the reader
+enum ESP32_RX_MODE
+{
+  ESP32_RX_QUEUE, //FreeRTOS queue, any number of readers
+  ESP32_RX_RING   //lock free ring, exactly one reader task
+};
+
+//a bus state change or error reported by the TWAI alerts, see getErrorEvent()
+typedef struct
+{
+  uint32_t timestamp; //esp_timer time the alert was read, low 32 bits (same clock as frame timestamps)
+  uint8_t type;       //ESP32_EVENT_*
+  uint8_t txErrors;   //transmit error counter at that moment (saturated to 255)
+  uint8_t rxErrors;   //receive error counter at that moment (saturated to 255)
+  uint8_t reserved;
+} ESP32_ERROR_EVENT;
+
+//loss and backlog counters, see getDriverStats()
+typedef struct
+{
+  uint32_t twaiQueueMissed;   //TWAI driver rx queue (rx_queue_len) was full, frame lost
+  uint32_t twaiFifoOverruns;  //controller RX FIFO overran before the driver emptied it
+  uint32_t rxQueueFull;       //accepted frames dropped because rx_queue / the ring was full
+  uint32_t callbackQueueFull; //frames dropped because callbackQueue was full
+  uint16_t rxHighWater;       //most frames ever waiting in rx_queue / the ring
+  uint16_t callbackHighWater; //most frames ever waiting in callbackQueue
+  uint32_t txSent;            //frames the controller got onto the bus
+  uint32_t txFailed;          //frames refused by the driver, failed on the bus or lost to bus off / reinstall
+  uint32_t txQueueFull;       //frames refused by sendFrame because tx_queue was full
+  uint16_t txHighWater;       //most frames ever waiting in tx_queue
+} ESP32_DRIVER_STATS;
+
 typedef struct
 {
     twai_timing_config_t cfg;
@@ -73,10 +178,13 @@ public:
   //block of functions which must be overriden from CAN_COMMON to implement functionality for this hardware
   int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended);
   int _setFilter(uint32_t id, uint32_t mask, bool extended);
+  int _clearFilter(uint8_t mailbox);
+  void applyFilters(); //reinstall the driver once if the hardware filter has changed
   void _init();
   uint32_t init(uint32_t ul_baudrate);
   uint32_t beginAutoSpeed();
   uint32_t set_baudrate(uint32_t ul_baudrate);
+  uint32_t reconfigure(uint32_t ul_baudrate, bool listenOnly);
   void setListenOnlyMode(bool state);
   void setNoACKMode(bool state);
   void enable();
@@ -84,10 +192,24 @@ public:
   bool sendFrame(CAN_FRAME& txFrame);
   bool rx_avail();
   void setTXBufferSize(int newSize);
+  void setTXQueueSize(int newSize); //frames sendFrame can park while the driver tx queue is full
+  uint16_t txQueueSpace(); //frames sendFrame can still park right now
+  uint16_t txInFlight(); //frames accepted by sendFrame that txSent / txFailed don't count yet
+  //queues and tasks are created by the first enable() and then kept, so these and
+  //setTXQueueSize have to be called before that
   void setRXBufferSize(int newSize);
+  void setCallbackQueueSize(int newSize); //frames waiting for callbacks
+  void setRXMode(ESP32_RX_MODE mode);
+  void setRXNotify(TaskHandle_t task); //ring mode: task to notify when the ring stops being empty
   uint16_t available(); //like rx_avail but returns the number of waiting frames
+  void getDriverStats(ESP32_DRIVER_STATS &stats);
+  bool getErrorEvent(ESP32_ERROR_EVENT &event); //oldest unread error event, false if none
+  void resetDriverStats();
   uint32_t get_rx_buff(CAN_FRAME &msg);
-  bool processFrame(twai_message_t &frame);
+  uint32_t get_rx_buffFD(CAN_FRAME_FD &msg);
+  size_t readBatch(CAN_FRAME *out, size_t max);
+  size_t readBatchFD(CAN_FRAME_FD *out, size_t max);
+  bool processFrame(twai_message_t &frame, uint64_t stamp);
   void sendCallback(CAN_FRAME *frame);
 
   void setCANPins(gpio_num_t rxPin, gpio_num_t txPin);
@@ -105,18 +227,79 @@ protected:
   twai_general_config_t twai_general_cfg = TWAI_GENERAL_CONFIG_DEFAULT(GPIO_NUM_17, GPIO_NUM_16, TWAI_MODE_NORMAL);
   twai_timing_config_t twai_speed_cfg = TWAI_TIMING_CONFIG_500KBITS();
   twai_filter_config_t twai_filters_cfg = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+  twai_filter_config_t installedFilter = TWAI_FILTER_CONFIG_ACCEPT_ALL(); //what the running driver was installed with
 
   QueueHandle_t callbackQueue;
   QueueHandle_t rx_queue;
+  QueueHandle_t eventQueue; //created on the first enable() and kept
+  QueueHandle_t tx_queue;   //frames waiting for room in the TWAI driver tx queue
+
+  ESP32_RX_MODE rxMode;
+  ESP32RXRing<ESP32_RX_RECORD> rxRing; //ring mode storage, allocated with the queues
+  TaskHandle_t rxNotifyTask;
+
+  //rx counters are written by task_LowLevelRX only, tx counters with txGate held. sendFrame
+  //never waits for the gate, what it refuses without it goes to txQueueFullUngated and is
+  //folded into txQueueFull by getDriverStats.
+  //The TWAI counters can't be cleared, so a reset just remembers where they were. What a
+  //driver counted is added to twaiQueueMissed / twaiFifoOverruns when it is uninstalled.
+  ESP32_DRIVER_STATS driverStats;
+  uint32_t twaiMissedBase;
+  uint32_t twaiOverrunBase;
+  uint32_t txInDriver;    //frames handed to the TWAI driver and not accounted for yet
+  uint32_t txFailedSeen;  //TWAI tx_failed_count at the last accountTX()
+  uint32_t txQueueFullUngated; //sendFrame refusals while txGate was taken, atomic
 
   TaskHandle_t CAN_WatchDog_Builtin_handler = NULL;
   TaskHandle_t task_CAN_handler = NULL;
   TaskHandle_t task_LowLevelRX_handler = NULL;
+  char taskNameCAN[16]; //FreeRTOS keeps its own copy but the names are built once and kept here
+  char taskNameRX[16];
+  char taskNameWD[16];
+
+  //the two tasks that block inside the driver each hold their gate while they are in it.
+  //Taking both gates (lockDriver) is what makes it safe to reinstall the driver.
+  SemaphoreHandle_t rxGate;
+  SemaphoreHandle_t alertGate;
+  SemaphoreHandle_t txGate; //tx_queue and the tx counters, only ever held for non blocking driver calls
+  volatile bool reconfiguring;
+  bool driverInstalled;
 
 private:
   // Pin variables
   ESP32_FILTER filters[BI_NUM_FILTERS];
   int rxBufferSize;
+  int callbackQueueSize;
+  int txQueueSize;
+
+  //lookup structures built from filters[] so processFrame does not scan every filter.
+  //activeTables is what findFilter uses, readingTables the set it is in right now (NULL
+  //when it is not looking) so compileFilters knows when the other set is free again.
+  ESP32_FILTER_TABLES filterTables[2];
+  ESP32_FILTER_TABLES * volatile activeTables;
+  ESP32_FILTER_TABLES * volatile readingTables;
+
+  void compileFilters();
+  int findFilter(uint32_t id, bool extended);
+  void updateHardwareFilter();
+
+  void createTasks();
+  void lockDriver();
+  void unlockDriver();
+  bool startDriver();
+  void stopDriver();
+
+  bool pushRX(const ESP32_RX_RECORD &rec);
+  bool pushCallback(const ESP32_RX_RECORD &rec);
+  int probeSpeed(const twai_timing_config_t &timing, uint32_t windowMs);
+  void handleAlerts(uint32_t alerts);
+  void serviceTX(uint32_t alerts);
+  void accountTX();
+  void pumpTX();
+  esp_err_t transmit(twai_message_t &msg);
+  void postEvent(uint8_t type, uint32_t stamp, twai_status_info_t &info);
+  bool popRX(ESP32_RX_RECORD &rec);
+  uint16_t rxWaiting();
 
   static void task_CAN(void *pvParameters);
   static void task_LowLevelRX(void *pvParameters);
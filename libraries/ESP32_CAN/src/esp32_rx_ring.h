@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+Lock free single producer / single consumer ring behind ESP32_RX_RING mode. Head is only
+written by the producer (task_LowLevelRX), tail only by the reader. Both run freely and are
+masked on access. They sit on their own cache lines so the two cores don't keep stealing
+the line. No FreeRTOS or driver dependencies, so the host tests use this very code.
+*/
+template <typename T>
+class ESP32RXRing
+{
+public:
+  ESP32RXRing() : records(NULL), mask(0), head(0), tail(0) {}
+
+  //size is rounded up to a power of two. Call before either side runs.
+  bool allocate(uint32_t minSize)
+  {
+    uint32_t size = 1;
+    while (size < minSize) size <<= 1;
+    records = (T *)malloc(size * sizeof(T));
+    mask = records ? size - 1 : 0;
+    head = 0;
+    tail = 0;
+    return records != NULL;
+  }
+
+  bool allocated() { return records != NULL; }
+
+  //producer side. False if the ring is full, otherwise waiting is the number of records in
+  //the ring including this one.
+  bool push(const T &rec, uint32_t &waiting)
+  {
+    uint32_t h = head;
+    uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (!records || h - t > mask) return false;
+    records[h & mask] = rec;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    waiting = h + 1 - t;
+    return true;
+  }
+
+  //producer side, right after a successful push: true if the reader had taken everything
+  //before that record, so it may be asleep and needs a wake up. The fence pairs with the one
+  //in pop() so either we see the reader's final tail or the reader sees our new head.
+  bool readerCaughtUp()
+  {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == head - 1;
+  }
+
+  //consumer side: take the oldest record
+  bool pop(T &rec)
+  {
+    uint32_t t = tail;
+    if (!records || __atomic_load_n(&head, __ATOMIC_ACQUIRE) == t) return false;
+    rec = records[t & mask];
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return true;
+  }
+
+  //consumer side
+  uint32_t waiting() { return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail; }
+
+private:
+  T *records;
+  uint32_t mask;
+  volatile uint32_t head __attribute__((aligned(32)));
+  volatile uint32_t tail __attribute__((aligned(32)));
+};
@@ -189,6 +189,13 @@ uint32_t CAN_COMMON::beginFD(uint32_t baudrate, uint32_t fastRate)
 	return 0;
 }
 
+uint32_t CAN_COMMON::reconfigure(uint32_t ul_baudrate, bool listenOnly)
+{
+	uint32_t result = init(ul_baudrate);
+	setListenOnlyMode(listenOnly);
+	return result;
+}
+
 uint32_t CAN_COMMON::begin(uint32_t baudrate, uint8_t enPin) 
 {
 	enablePin = enPin;
@@ -350,15 +357,12 @@ int CAN_COMMON::watchFor(uint32_t id, uint32_t mask)
 	else return setRXFilter(id, mask, false);
 }
 
-//A bit more complicated. Makes sure that the range from id1 to id2 is let through. This might open
-//the floodgates if you aren't careful.
-//There are undoubtedly better ways to calculate the proper values for the filter but this way seems to work.
-//It'll be kind of slow if you try to let a huge span through though.
+//A bit more complicated. Makes sure that the range from id1 to id2 is let through with a single
+//filter. This might open the floodgates if you aren't careful.
 int CAN_COMMON::watchForRange(uint32_t id1, uint32_t id2)
 {
-	uint32_t id = 0;
-	uint32_t mask = 0;
-	uint32_t temp;
+	uint32_t id, mask;
+	bool extended;
 
 	if (id1 > id2) 
 	{   //looks funny I know. In place swap with no temporary storage. Neato!
@@ -366,32 +370,106 @@ int CAN_COMMON::watchForRange(uint32_t id1, uint32_t id2)
 		id2 = id1 ^ id2; //note difference here.
 		id1 = id1 ^ id2;
 	}
+	extended = (id2 > 0x7FF);
 
-	id = id1;
-
-	if (id2 <= 0x7FF) mask = 0x7FF;
-	else mask = 0x1FFFFFFF;
-
-	/* Here is a quick overview of the theory behind these calculations.
-	   We start with mask set to 11 or 29 set bits (all 1's)
-	   and id set to the lowest ID in the range.
-	   From there we go through every single ID possible in the range. For each ID
-	   we AND with the current ID. At the end only bits that never changed and were 1's
-	   will still be 1's. This yields the ID we can match against to let these frames through
-	   The mask is calculated by finding the bitfield difference between the lowest ID and
-	   the current ID. This calculation will be 1 anywhere the bits were different. We invert
-	   this so that it is 1 anywhere the bits where the same. Then we AND with the current Mask.
-	   At the end the mask will be 1 anywhere the bits never changed. This is the perfect mask.
+	/* Only the bits above the highest bit in which id1 and id2 differ are the same for every
+	   ID in the range. Below it the range necessarily passes from ...0111 to ...1000 so every
+	   lower bit takes both values. The mask is therefore the common prefix of id1 and id2 and
+	   the id is id1 with everything below that prefix cleared. No need to visit every ID.
 	*/
-	for (uint32_t c = id1; c <= id2; c++)
+	mask = extended ? 0x1FFFFFFF : 0x7FF;
+	mask &= ~_lowBitsMask(id1 ^ id2);
+	id = id1 & mask;
+	return setRXFilter(id, mask, extended);
+}
+
+//Let exactly the IDs from id1 to id2 through by splitting the range into aligned power of two
+//blocks, one id/mask filter each (the minimal set of such filters for a range). Uses at most
+//maxFilters filters (never more than the driver has): if the exact cover needs more it falls
+//back to the single broader filter of watchForRange. Returns the number of filters set, or -1
+//if setting one failed, in which case the filters this call already set are removed again.
+int CAN_COMMON::watchForRange(uint32_t id1, uint32_t id2, uint8_t maxFilters)
+{
+	uint32_t lo, hi, fullMask;
+	bool extended;
+	uint8_t mailboxes[32]; //what this call set, for undoing it
+	int count = 0;
+
+	if (id1 > id2)
 	{
-		id &= c;
-		temp = (~(id1 ^ c)) & 0x1FFFFFFF;
-		mask &= temp;
+		lo = id2;
+		hi = id1;
 	}
-	//output of the above crazy loop is actually the end result.
-	if (id > 0x7FF) return setRXFilter(id, mask, true);
-	else return setRXFilter(id, mask, false);
+	else
+	{
+		lo = id1;
+		hi = id2;
+	}
+	extended = (hi > 0x7FF);
+	fullMask = extended ? 0x1FFFFFFF : 0x7FF;
+	if (maxFilters > numFilters) maxFilters = (numFilters > 0) ? numFilters : 0;
+	if (maxFilters > sizeof(mailboxes)) maxFilters = sizeof(mailboxes);
+
+	if (_rangeBlocks(lo, hi) > maxFilters) return (watchForRange(lo, hi) < 0) ? -1 : 1;
+
+	while (true)
+	{
+		uint32_t size = _blockSize(lo, hi);
+		int mailbox = setRXFilter(lo, fullMask & ~(size - 1), extended);
+		if (mailbox < 0)
+		{
+			while (count > 0) _clearFilter(mailboxes[--count]);
+			return -1;
+		}
+		mailboxes[count++] = (uint8_t)mailbox;
+		if (hi - lo < size) break; //that block ended exactly at hi
+		lo += size;
+	}
+	return count;
+}
+
+//bits 0 .. highest set bit of value, all set (0 for 0)
+uint32_t CAN_COMMON::_lowBitsMask(uint32_t value)
+{
+	value |= value >> 1;
+	value |= value >> 2;
+	value |= value >> 4;
+	value |= value >> 8;
+	value |= value >> 16;
+	return value;
+}
+
+//largest power of two block starting at lo that is aligned to its size and ends at or before hi
+uint32_t CAN_COMMON::_blockSize(uint32_t lo, uint32_t hi)
+{
+	uint32_t size = lo ? (lo & (~lo + 1)) : 0x20000000; //alignment of lo (IDs are at most 29 bits)
+	while (size - 1 > hi - lo) size >>= 1;
+	return size;
+}
+
+//how many filters the exact cover of lo..hi takes
+int CAN_COMMON::_rangeBlocks(uint32_t lo, uint32_t hi)
+{
+	int count = 0;
+	while (true)
+	{
+		uint32_t size = _blockSize(lo, hi);
+		count++;
+		if (hi - lo < size) break;
+		lo += size;
+	}
+	return count;
+}
+
+void CAN_COMMON::applyFilters()
+{
+}
+
+//Drivers that can free a filter again override this. Used to undo a partly set up
+//watchForRange, the default cannot and just reports that.
+int CAN_COMMON::_clearFilter(uint8_t mailbox)
+{
+	return -1;
 }
 
 //these next few functions would normally be pure abstract but they're implemented here
@@ -415,6 +493,20 @@ uint32_t CAN_COMMON::initFD(uint32_t nominalRate, uint32_t dataRate)
 	return 0;
 }
 
+size_t CAN_COMMON::readBatch(CAN_FRAME *out, size_t max)
+{
+	size_t count = 0;
+	while (count < max && get_rx_buff(out[count])) count++;
+	return count;
+}
+
+size_t CAN_COMMON::readBatchFD(CAN_FRAME_FD *out, size_t max)
+{
+	size_t count = 0;
+	while (count < max && get_rx_buffFD(out[count])) count++;
+	return count;
+}
+
 //try to put a standard CAN frame into a CAN_FRAME_FD structure
 bool CAN_COMMON::canToFD(CAN_FRAME &source, CAN_FRAME_FD &dest)
 {
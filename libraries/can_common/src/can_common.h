@@ -200,6 +200,9 @@ public:
     virtual uint32_t beginAutoSpeed() = 0;
     virtual uint32_t set_baudrate(uint32_t ul_baudrate) = 0;
     virtual void setListenOnlyMode(bool state) = 0;
+    //change speed and listen only mode in one step, filters are reset like begin() does.
+    //The default just calls both, drivers that can should avoid restarting twice.
+    virtual uint32_t reconfigure(uint32_t ul_baudrate, bool listenOnly);
 	virtual void enable() = 0;
 	virtual void disable() = 0;
 	virtual bool sendFrame(CAN_FRAME& txFrame) = 0;
@@ -211,6 +214,16 @@ public:
     virtual uint32_t set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed);
     virtual bool sendFrameFD(CAN_FRAME_FD& txFrame);
     virtual uint32_t initFD(uint32_t nominalRate, uint32_t dataRate);    
+    //Pull up to max waiting frames in one call, returns how many were stored in out.
+    //The defaults just loop over get_rx_buff / get_rx_buffFD, drivers can do better.
+    virtual size_t readBatch(CAN_FRAME *out, size_t max);
+    virtual size_t readBatchFD(CAN_FRAME_FD *out, size_t max);
+    //Drivers that can only change their hardware filter by restarting defer that until this
+    //is called (or the next restart), so a batch of watchFor calls costs one restart.
+    //The default does nothing, filters take effect right away.
+    virtual void applyFilters();
+    //Stop using a filter / mailbox set up before. Returns the mailbox or -1 if not supported.
+    virtual int _clearFilter(uint8_t mailbox);
 
     //Public API common to all subclasses - don't need to be re-implemented
     //wrapper for syntactic sugar reasons
@@ -222,6 +235,7 @@ public:
     int watchFor(uint32_t id, uint32_t mask); //allow a range of ids through
     int watchFor(uint32_t id, uint32_t mask, bool ext);
 	int watchForRange(uint32_t id1, uint32_t id2); //try to allow the range from id1 to id2 - automatically determine base ID and mask
+	int watchForRange(uint32_t id1, uint32_t id2, uint8_t maxFilters); //allow exactly id1 to id2 using up to maxFilters filters
 	uint32_t begin();
 	uint32_t begin(uint32_t baudrate);
     uint32_t begin(uint32_t baudrate, uint8_t enPin);
@@ -273,6 +287,11 @@ protected:
     bool faulted;
     bool rxFault;
     bool txFault;    
+
+    //helpers for watchForRange
+    static uint32_t _lowBitsMask(uint32_t value);
+    static uint32_t _blockSize(uint32_t lo, uint32_t hi);
+    static int _rangeBlocks(uint32_t lo, uint32_t hi);
 };
 
 #endif
@@ -0,0 +1,257 @@
+/*
+Host test for delta mode (PROTO_SET_DELTA_MODE, src/payload_delta.cpp) through CommBuffer.
+Frames from a few hot and thousands of cold IDs go through a link that only drains now and
+then, so the ring overflows and the encoder table evicts all the time. The stream is decoded
+the way a client would, with PayloadDeltaDecoder, clearing it on every delta reset packet.
+Every frame that arrives must decode to exactly the payload that was sent.
+
+Build and run from libraries/can_common:
+  g++ -std=gnu++17 -O2 -Itest/stubs -Isrc -I../ESP32_CAN/src -I../../src test/payload_delta_test.cpp src/can_common.cpp ../../src/commbuffer.cpp ../../src/ascii_frame.cpp ../../src/payload_delta.cpp -o payload_delta_test && ./payload_delta_test
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <vector>
+#include "commbuffer.h"
+#include "gvret_comm.h"
+#include "Logger.h"
+
+EEPROMSettings settings;
+void Logger::debug(const char *, ...) {}
+
+#define HOT_IDS 200
+#define COLD_IDS 6000 //more than the old fixed size decoder could hold
+
+class Capture : public Print
+{
+public:
+    std::vector<uint8_t> bytes;
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        bytes.insert(bytes.end(), buffer, buffer + size);
+        return size;
+    }
+};
+
+struct SentFrame
+{
+    uint32_t id;
+    bool extended;
+    uint8_t bus;
+    uint8_t length;
+    uint8_t data[8];
+};
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL " __VA_ARGS__); printf("\n"); return; } } while (0)
+
+static uint32_t rng = 12345;
+static uint32_t nextRandom()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static uint32_t readU32(const std::vector<uint8_t> &s, size_t pos)
+{
+    return s[pos] | (s[pos + 1] << 8) | (s[pos + 2] << 16) | ((uint32_t)s[pos + 3] << 24);
+}
+
+static uint32_t readVarint(const std::vector<uint8_t> &s, size_t &pos)
+{
+    uint32_t v = 0;
+    for (int shift = 0; pos < s.size(); shift += 7)
+    {
+        uint8_t b = s[pos++];
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    return v;
+}
+
+struct DecodeStats
+{
+    uint32_t frames;
+    uint32_t deltas;
+    uint32_t resets;
+    int64_t lastSeq;
+};
+
+//one frame out of the stream: payload is the full data or, if isDelta, the bitmap and changed bytes
+static bool checkFrame(PayloadDeltaDecoder &decoder, const std::vector<SentFrame> &sent, DecodeStats &stats, uint32_t seq,
+                       uint32_t id, bool extended, uint8_t lenBus, bool isDelta, const uint8_t *payload, int &used, const char *name)
+{
+    uint8_t length = lenBus & 0xF, bus = (lenBus >> 4) & 7;
+    uint8_t data[8];
+
+    if (seq >= sent.size() || (int64_t)seq <= stats.lastSeq)
+    {
+        printf("FAIL %s: frame %u after %lld\n", name, (unsigned)seq, (long long)stats.lastSeq);
+        return false;
+    }
+    const SentFrame &f = sent[seq];
+    if (f.id != id || f.extended != extended || f.bus != bus || f.length != length)
+    {
+        printf("FAIL %s: frame %u header\n", name, (unsigned)seq);
+        return false;
+    }
+    if (isDelta)
+    {
+        used = decoder.apply(id, extended, bus, length, payload, data);
+        if (used < 0)
+        {
+            printf("FAIL %s: frame %u is a delta for an ID the decoder does not have\n", name, (unsigned)seq);
+            return false;
+        }
+        stats.deltas++;
+    }
+    else
+    {
+        decoder.keyframe(id, extended, bus, length, payload);
+        memcpy(data, payload, length);
+        used = length;
+    }
+    if (memcmp(data, f.data, length) != 0)
+    {
+        printf("FAIL %s: frame %u decodes to the wrong payload\n", name, (unsigned)seq);
+        return false;
+    }
+    stats.lastSeq = seq;
+    stats.frames++;
+    return true;
+}
+
+static void decodeStream(const std::vector<uint8_t> &s, const std::vector<SentFrame> &sent, CommBuffer &buf, const char *name)
+{
+    static PayloadDeltaDecoder decoder;
+    DecodeStats stats = {0, 0, 0, -1};
+    size_t pos = 0;
+    int used;
+
+    decoder.clear();
+    while (pos < s.size())
+    {
+        CHECK(s.size() - pos >= 7 && s[pos] == 0xF1, "%s: garbage at byte %zu", name, pos);
+        uint8_t cmd = s[pos + 1];
+        if (cmd == PROTO_BUILD_CAN_FRAME || cmd == PROTO_SET_DELTA_MODE)
+        {
+            uint32_t seq = readU32(s, pos + 2);
+            uint32_t id = readU32(s, pos + 6);
+            uint8_t lenBus = s[pos + 10];
+            if (cmd == PROTO_SET_DELTA_MODE && !(lenBus & 0x80))
+            {
+                CHECK(id == 0 && lenBus == 0, "%s: bad delta reset packet at byte %zu", name, pos);
+                decoder.clear();
+                stats.resets++;
+                pos += 12;
+                continue;
+            }
+            CHECK(checkFrame(decoder, sent, stats, seq, id & 0x7FFFFFFF, id >> 31, lenBus, cmd == PROTO_SET_DELTA_MODE,
+                             &s[pos + 11], used, name), "%s: at byte %zu", name, pos);
+            pos += 12 + used;
+        }
+        else if (cmd == PROTO_BATCH_FRAMES)
+        {
+            uint32_t stamp = readU32(s, pos + 2);
+            uint8_t count = s[pos + 6];
+            pos += 7;
+            for (int r = 0; r < count; r++)
+            {
+                uint32_t zigzag = readVarint(s, pos);
+                stamp += (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+                uint32_t idExt = readVarint(s, pos);
+                uint8_t lenBus = s[pos++];
+                CHECK(checkFrame(decoder, sent, stats, stamp, idExt >> 1, idExt & 1, lenBus & 0x7F, lenBus & 0x80,
+                                 &s[pos], used, name), "%s: batch record %d", name, r);
+                pos += used;
+            }
+            pos++; //checksum
+        }
+        else
+        {
+            CHECK(false, "%s: unknown record %02X at byte %zu", name, cmd, pos);
+        }
+    }
+
+    CHECK(stats.frames + buf.getDroppedFrames() == sent.size(), "%s: %u frames received + %u dropped != %zu sent", name,
+          (unsigned)stats.frames, (unsigned)buf.getDroppedFrames(), sent.size());
+    CHECK(stats.deltas > stats.frames / 4 && stats.resets > 1, "%s: only %u deltas, %u resets, nothing was tested", name,
+          (unsigned)stats.deltas, (unsigned)stats.resets);
+    printf("%s: %u frames (%u as deltas, %u dropped), %u delta resets\n", name, (unsigned)stats.frames,
+           (unsigned)stats.deltas, (unsigned)buf.getDroppedFrames(), (unsigned)stats.resets);
+}
+
+static void deltaRun(const char *name, uint8_t batchSize, uint8_t keyframeInterval, uint32_t frames)
+{
+    static CommBuffer buf;
+    static SentFrame idState[HOT_IDS + COLD_IDS];
+    std::vector<SentFrame> sent;
+    Capture link;
+    CAN_FRAME frame;
+
+    buf.clearBufferedBytes();
+    buf.resetCounters();
+    buf.setBatchSize(batchSize);
+    buf.setDeltaMode(keyframeInterval);
+    for (int i = 0; i < HOT_IDS + COLD_IDS; i++)
+    {
+        SentFrame &f = idState[i];
+        f.extended = i >= HOT_IDS;
+        f.id = f.extended ? 0x18DA0000 + i * 7 : i * 10;
+        f.bus = i % 2;
+        f.length = 1 + i % 8;
+        for (int c = 0; c < 8; c++)
+            f.data[c] = (uint8_t)nextRandom();
+    }
+
+    uint32_t nextDrain = 0;
+    for (uint32_t seq = 0; seq < frames; seq++)
+    {
+        //nine frames in ten from the hot IDs, which mostly change one byte
+        SentFrame &f = idState[(nextRandom() % 10) ? nextRandom() % HOT_IDS : HOT_IDS + nextRandom() % COLD_IDS];
+        uint32_t r = nextRandom();
+        if ((r & 0xFF) == 0)
+            f.length = 1 + (r >> 8) % 8;
+        else if (r & 0x100)
+            f.data[(r >> 9) % f.length] = (uint8_t)(r >> 16);
+        sent.push_back(f);
+
+        frame.id = f.id;
+        frame.extended = f.extended;
+        frame.rtr = 0;
+        frame.timestamp = seq;
+        frame.length = f.length;
+        memcpy(frame.data.uint8, f.data, 8);
+        buf.sendFrameToBuffer(frame, f.bus);
+
+        //the link wakes up at random, sometimes too late
+        if (seq == nextDrain)
+        {
+            buf.drainTo(link);
+            nextDrain = seq + 1 + nextRandom() % 400;
+        }
+    }
+    buf.flushBatch();
+    buf.drainTo(link);
+    decodeStream(link.bytes, sent, buf, name);
+}
+
+int main()
+{
+    settings.useBinarySerialComm = true;
+
+    deltaRun("single frame packets", 0, 20, 500000);
+    deltaRun("batches of 16", 16, 20, 500000);
+    deltaRun("batches of 64, rare keyframes", 64, 250, 500000);
+
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("Delta mode: all passed\n");
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+Host test for the default CAN_COMMON::readBatch / readBatchFD (src/can_common.cpp) against a
+stub driver. Checks that frames come out whole and in order, that a batch never reads past
+max (a frame taken from the driver cannot be put back), and that a driver without FD
+support gives empty FD batches. Then times draining through readBatch against the old
+available() + read() loop.
+
+Build and run from libraries/can_common:
+  g++ -std=gnu++17 -O2 -Itest/stubs -Isrc test/read_batch_test.cpp src/can_common.cpp -o read_batch_test && ./read_batch_test
+*/
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include "can_common.h"
+
+#define STUB_QUEUE_SIZE 4096
+#define CAN_READ_BATCH_TEST 16 //CAN_READ_BATCH in src/can_manager.h
+
+//Driver with a plain receive queue. Every queue call takes a lock, like the FreeRTOS
+//queue calls of the real drivers enter a critical section.
+class StubCAN : public CAN_COMMON
+{
+public:
+    CAN_FRAME queue[STUB_QUEUE_SIZE];
+    int head, tail;
+    int rxCalls; //get_rx_buff calls, successful or not
+    std::mutex lock;
+
+    StubCAN() : CAN_COMMON(1) { head = tail = rxCalls = 0; }
+
+    void push(CAN_FRAME &frame) { queue[head++ % STUB_QUEUE_SIZE] = frame; }
+
+    uint32_t get_rx_buff(CAN_FRAME &msg)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        rxCalls++;
+        if (tail == head) return 0;
+        msg = queue[tail++ % STUB_QUEUE_SIZE];
+        return 1;
+    }
+    uint16_t available()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return head - tail;
+    }
+    bool rx_avail() { return available() > 0; }
+
+    int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended) { return -1; }
+    int _setFilter(uint32_t id, uint32_t mask, bool extended) { return -1; }
+    uint32_t init(uint32_t ul_baudrate) { return ul_baudrate; }
+    uint32_t beginAutoSpeed() { return 0; }
+    uint32_t set_baudrate(uint32_t ul_baudrate) { return ul_baudrate; }
+    void setListenOnlyMode(bool state) {}
+    void enable() {}
+    void disable() {}
+    bool sendFrame(CAN_FRAME& txFrame) { return false; }
+};
+
+//Same queue, also handed out as FD frames
+class StubCANFD : public StubCAN
+{
+public:
+    uint32_t get_rx_buffFD(CAN_FRAME_FD &msg)
+    {
+        CAN_FRAME frame;
+        if (!get_rx_buff(frame)) return 0;
+        return canToFD(frame, msg) ? 1 : 0;
+    }
+};
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL " __VA_ARGS__); printf("\n"); return; } } while (0)
+
+static void fillFrame(CAN_FRAME &frame, uint32_t seq)
+{
+    frame.id = (seq * 7) & 0x1FFFFFFF;
+    frame.extended = seq & 1;
+    frame.rtr = 0;
+    frame.timestamp = seq;
+    frame.length = seq % 9;
+    frame.data.uint64 = 0;
+    for (int i = 0; i < frame.length; i++)
+        frame.data.uint8[i] = (uint8_t)(seq >> i);
+}
+
+static bool sameFrame(CAN_FRAME &frame, uint32_t seq)
+{
+    CAN_FRAME expect;
+    fillFrame(expect, seq);
+    return frame.id == expect.id && frame.extended == expect.extended && frame.timestamp == seq &&
+           frame.length == expect.length && frame.data.uint64 == expect.data.uint64;
+}
+
+//frames come out in order and a batch stops at max without taking one more from the driver
+static void batchesInOrder()
+{
+    static StubCAN can;
+    CAN_FRAME out[17]; //one more than asked for, must stay untouched
+    uint32_t seq = 0, next = 0;
+
+    for (int round = 0; round < 1000; round++)
+    {
+        int queued = (round * 13) % 40;
+        for (int i = 0; i < queued; i++)
+        {
+            CAN_FRAME frame;
+            fillFrame(frame, seq++);
+            can.push(frame);
+        }
+        size_t max = 1 + round % 16;
+        while (true)
+        {
+            int waiting = can.available();
+            int callsBefore = can.rxCalls;
+            out[max].timestamp = 0xDEADBEEF;
+            size_t count = can.readBatch(out, max);
+            CHECK(count == (size_t)(waiting < (int)max ? waiting : max), "round %d: %zu frames of %d waiting, max %zu", round, count, waiting, max);
+            //one call per frame, plus the one that found the queue empty if the batch is not full
+            CHECK(can.rxCalls - callsBefore == (int)count + (count < max ? 1 : 0), "round %d: %d driver reads for %zu frames", round,
+                  can.rxCalls - callsBefore, count);
+            CHECK(out[max].timestamp == 0xDEADBEEF, "round %d: wrote past max", round);
+            for (size_t i = 0; i < count; i++)
+                CHECK(sameFrame(out[i], next++), "round %d: frame %u wrong or out of order", round, (unsigned)(next - 1));
+            if (count < max)
+                break;
+        }
+    }
+    CHECK(next == seq, "%u of %u frames read", (unsigned)next, (unsigned)seq);
+
+    CHECK(can.readBatch(out, 0) == 0 && can.readBatch(out, 16) == 0, "read from an empty driver");
+    CAN_FRAME frame;
+    fillFrame(frame, 0);
+    can.push(frame);
+    int callsBefore = can.rxCalls;
+    CHECK(can.readBatch(out, 0) == 0 && can.rxCalls == callsBefore && can.available() == 1, "max 0 took a frame");
+}
+
+static void batchesFD()
+{
+    static StubCAN classicOnly;
+    static StubCANFD fd;
+    CAN_FRAME_FD out[16];
+    CAN_FRAME frame;
+
+    for (uint32_t seq = 0; seq < 100; seq++)
+    {
+        fillFrame(frame, seq);
+        classicOnly.push(frame);
+        fd.push(frame);
+    }
+    CHECK(classicOnly.readBatchFD(out, 16) == 0 && classicOnly.available() == 100, "driver without FD gave FD frames");
+
+    uint32_t next = 0;
+    size_t count;
+    while ((count = fd.readBatchFD(out, 16)) > 0)
+    {
+        for (size_t i = 0; i < count; i++, next++)
+        {
+            CAN_FRAME back;
+            CHECK(fd.fdToCan(out[i], back) && sameFrame(back, next), "FD frame %u", (unsigned)next);
+        }
+    }
+    CHECK(next == 100, "%u of 100 FD frames read", (unsigned)next);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//drain the queue in bursts of 16 frames, the way CANManager::loop does, both ways
+static void benchmark()
+{
+    static StubCAN can;
+    static CAN_FRAME frames[16];
+    const int bursts = 500000;
+    uint32_t sum = 0;
+
+    for (int i = 0; i < 16; i++)
+        fillFrame(frames[i], i);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int b = 0; b < bursts; b++)
+    {
+        for (int i = 0; i < 16; i++)
+            can.push(frames[i]);
+        CAN_FRAME incoming;
+        while (can.available() > 0)
+        {
+            can.read(incoming);
+            sum += incoming.id;
+        }
+    }
+    double perFrame = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int b = 0; b < bursts; b++)
+    {
+        for (int i = 0; i < 16; i++)
+            can.push(frames[i]);
+        CAN_FRAME batch[CAN_READ_BATCH_TEST];
+        size_t count;
+        while ((count = can.readBatch(batch, CAN_READ_BATCH_TEST)) > 0)
+            for (size_t i = 0; i < count; i++)
+                sum += batch[i].id;
+    }
+    double batched = secondsSince(start);
+
+    printf("available() + read(): %.1f Mframes/s, readBatch: %.1f Mframes/s (%u)\n", bursts * 16 / perFrame / 1e6,
+           bursts * 16 / batched / 1e6, (unsigned)(sum & 1));
+}
+
+int main()
+{
+    batchesInOrder();
+    batchesFD();
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    benchmark();
+    printf("readBatch: all passed\n");
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+Host test and benchmark for ESP32RXRing (../ESP32_CAN/src/esp32_rx_ring.h), the ring behind
+ESP32_RX_RING mode. A producer thread plays task_LowLevelRX and a consumer thread plays the
+drain task, with the same empty -> not empty wake up pushRX does. Checks that every record
+the ring accepted comes out once, whole and in order, that it holds exactly its size,
+and that no wake up gets lost. Then compares frames/s and CPU time per frame
+with a mutex protected queue standing in for the FreeRTOS queue of ESP32_RX_QUEUE mode.
+
+Build and run from libraries/can_common:
+  g++ -std=gnu++17 -O2 -pthread -Itest/stubs -Isrc -I../ESP32_CAN/src test/rx_ring_test.cpp -o rx_ring_test && ./rx_ring_test
+*/
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "esp32_can_builtin.h"
+
+#define RING_SIZE 256 //BI_RX_BUFFER_SIZE rounded up the way createTasks does
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL " __VA_ARGS__); printf("\n"); return; } } while (0)
+
+//xTaskNotifyGive / ulTaskNotifyTake(pdTRUE, timeout)
+class Notify
+{
+public:
+    void give()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        count++;
+        wake.notify_one();
+    }
+    bool take(int timeoutMs)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        bool got = wake.wait_for(guard, std::chrono::milliseconds(timeoutMs), [this] { return count > 0; });
+        count = 0;
+        return got;
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    int count = 0;
+};
+
+//what ESP32_RX_QUEUE mode costs: every call locks, like a FreeRTOS queue call enters a critical section
+class LockedQueue
+{
+public:
+    bool push(const ESP32_RX_RECORD &rec)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (head - tail >= RING_SIZE) return false;
+        records[head++ % RING_SIZE] = rec;
+        return true;
+    }
+    bool pop(ESP32_RX_RECORD &rec)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (head == tail) return false;
+        rec = records[tail++ % RING_SIZE];
+        return true;
+    }
+
+private:
+    std::mutex lock;
+    ESP32_RX_RECORD records[RING_SIZE];
+    uint32_t head = 0, tail = 0;
+};
+
+static void fillRecord(ESP32_RX_RECORD &rec, uint32_t seq)
+{
+    rec.id = seq & ESP32_RX_ID_MASK;
+    rec.timestamp = seq;
+    for (int i = 0; i < 8; i++)
+        rec.data[i] = (uint8_t)(seq * 31 + i);
+    rec.length = seq % 9;
+    rec.mailbox = 0xFF;
+    rec.listener = (uint8_t)seq;
+    rec.reserved = 0;
+}
+
+static bool sameRecord(const ESP32_RX_RECORD &rec, uint32_t seq)
+{
+    ESP32_RX_RECORD expect;
+    fillRecord(expect, seq);
+    return memcmp(&rec, &expect, sizeof(rec)) == 0;
+}
+
+//single threaded: exactly RING_SIZE records fit, and one more once one was taken
+static void fillUp()
+{
+    static ESP32RXRing<ESP32_RX_RECORD> ring;
+    ESP32_RX_RECORD rec;
+    uint32_t waiting = 0, seq = 0;
+
+    CHECK(!ring.pop(rec) && !ring.push(rec, waiting), "used before it was allocated");
+    ring.allocate(RING_SIZE - 10); //rounded up
+    for (int round = 0; round < 3; round++) //indices keep running, the mask wraps them
+    {
+        for (int i = 0; i < RING_SIZE; i++)
+        {
+            fillRecord(rec, seq++);
+            CHECK(ring.push(rec, waiting) && waiting == (uint32_t)i + 1, "push %d refused or miscounted", i);
+        }
+        CHECK(!ring.push(rec, waiting) && ring.waiting() == RING_SIZE, "pushed into a full ring");
+        CHECK(ring.pop(rec) && sameRecord(rec, seq - RING_SIZE), "first record out");
+        fillRecord(rec, seq++);
+        CHECK(ring.push(rec, waiting) && waiting == RING_SIZE, "no room after a pop");
+        for (uint32_t s = seq - RING_SIZE; s < seq; s++)
+            CHECK(ring.pop(rec) && sameRecord(rec, s), "record %u", (unsigned)s);
+        CHECK(!ring.pop(rec) && ring.waiting() == 0, "popped from an empty ring");
+    }
+}
+
+/*
+burst records at a time, then a pause, so the ring keeps running empty (the wake up edge)
+and, with a slow consumer, full (the refusals).
+*/
+static void ringRun(const char *name, uint32_t records, int burst, int producerPauseUs, int consumerPauseUs)
+{
+    static ESP32RXRing<ESP32_RX_RECORD> ring;
+    static std::vector<uint8_t> accepted;
+    Notify notify;
+    std::atomic<bool> done(false);
+    uint32_t refused = 0, received = 0, lostWakeups = 0, overfull = 0;
+    int64_t last = -1;
+    bool bad = false;
+
+    if (!ring.allocated())
+        ring.allocate(RING_SIZE);
+    accepted.assign(records, 0);
+
+    std::thread consumer([&]() {
+        ESP32_RX_RECORD rec;
+        while (true)
+        {
+            bool finished = done;
+            while (ring.pop(rec))
+            {
+                uint32_t seq = rec.timestamp;
+                if (seq >= records || (int64_t)seq <= last || !sameRecord(rec, seq) || !accepted[seq])
+                    bad = true;
+                last = seq;
+                received++;
+                if (consumerPauseUs && (received & 63) == 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(consumerPauseUs));
+            }
+            if (finished)
+                break;
+            //like the drain task, but the timeout is long: running into it with records
+            //waiting means a wake up was lost
+            if (!notify.take(200) && ring.waiting() > 0)
+                lostWakeups++;
+        }
+    });
+
+    ESP32_RX_RECORD rec;
+    for (uint32_t seq = 0; seq < records; seq++)
+    {
+        fillRecord(rec, seq);
+        uint32_t waiting;
+        accepted[seq] = 1; //before the push, the consumer may check it right away
+        if (!ring.push(rec, waiting))
+        {
+            accepted[seq] = 0;
+            refused++;
+            continue;
+        }
+        if (waiting > RING_SIZE)
+            overfull++;
+        if (ring.readerCaughtUp())
+            notify.give();
+        if (producerPauseUs && (seq % burst) == (uint32_t)burst - 1)
+            std::this_thread::sleep_for(std::chrono::microseconds(producerPauseUs));
+        else if (!producerPauseUs && (seq & 31) == 0)
+            std::this_thread::yield(); //on a single core host the reader would hardly run
+    }
+    done = true;
+    notify.give();
+    consumer.join();
+
+    CHECK(!bad, "%s: a record came out twice, changed or out of order", name);
+    CHECK(received + refused == records, "%s: %u received + %u refused != %u pushed", name, (unsigned)received,
+          (unsigned)refused, (unsigned)records);
+    CHECK(lostWakeups == 0, "%s: %u lost wake ups", name, (unsigned)lostWakeups);
+    CHECK(overfull == 0, "%s: %u pushes past the ring size", name, (unsigned)overfull);
+    printf("%s: %u records, %u refused\n", name, (unsigned)received, (unsigned)refused);
+}
+
+static double cpuSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//both threads flat out, the producer retries when full so every record gets through
+template <typename Push, typename Pop>
+static void timeTransfer(const char *name, uint32_t records, Push push, Pop pop)
+{
+    auto start = std::chrono::steady_clock::now();
+    double cpuStart = cpuSeconds();
+    uint32_t sum = 0;
+
+    std::thread consumer([&]() {
+        ESP32_RX_RECORD rec;
+        for (uint32_t got = 0; got < records;)
+        {
+            if (pop(rec))
+            {
+                sum += rec.id;
+                got++;
+            }
+            else
+                std::this_thread::yield();
+        }
+    });
+    ESP32_RX_RECORD rec;
+    for (uint32_t seq = 0; seq < records; seq++)
+    {
+        fillRecord(rec, seq);
+        while (!push(rec))
+            std::this_thread::yield();
+    }
+    consumer.join();
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = cpuSeconds() - cpuStart;
+    printf("%-13s %6.1f Mframes/s, %5.1f ns CPU per frame (%u)\n", name, records / wall / 1e6, cpu * 1e9 / records,
+           (unsigned)(sum & 1));
+}
+
+static void benchmark()
+{
+    static ESP32RXRing<ESP32_RX_RECORD> ring;
+    static LockedQueue queue;
+    const uint32_t records = 20000000;
+
+    ring.allocate(RING_SIZE);
+    timeTransfer("locked queue:", records, [](const ESP32_RX_RECORD &r) { return queue.push(r); },
+                 [](ESP32_RX_RECORD &r) { return queue.pop(r); });
+    timeTransfer("ring:", records, [](const ESP32_RX_RECORD &r) { uint32_t w; return ring.push(r, w); },
+                 [](ESP32_RX_RECORD &r) { return ring.pop(r); });
+}
+
+int main()
+{
+    fillUp();
+    //1 Mbit/s classic CAN tops out around 18000 frames per second, here in bursts of 16
+    ringRun("bursts, fast reader", 40000, 16, 500, 0);
+    ringRun("flat out, fast reader", 5000000, 1, 0, 0);
+    ringRun("flat out, slow reader", 200000, 1, 0, 20);
+
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    benchmark();
+    printf("ESP32RXRing: all passed\n");
+    return 0;
+}
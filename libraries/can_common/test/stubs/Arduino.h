@@ -0,0 +1,42 @@
+//Just enough of the Arduino / ESP32 core to build the library and firmware sources the
+//tests in this directory use on the host. Nothing in here talks to hardware.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(4, 4, 0)
+#define SOC_TWAI_CONTROLLER_NUM 1
+
+inline uint32_t micros()
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+inline uint32_t millis() { return micros() / 1000; }
+
+class String
+{
+public:
+    String(const char *str = "") { snprintf(buff, sizeof(buff), "%s", str); }
+    void toCharArray(char *out, unsigned int size) { snprintf(out, size, "%s", buff); }
+    const char *c_str() const { return buff; }
+private:
+    char buff[300];
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+};
@@ -0,0 +1,5 @@
+#pragma once
+
+typedef int gpio_num_t;
+#define GPIO_NUM_16 16
+#define GPIO_NUM_17 17
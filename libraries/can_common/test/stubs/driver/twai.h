@@ -0,0 +1,46 @@
+//TWAI driver types for the host, only what esp32_can_builtin.h needs to compile
+#pragma once
+#include <stdint.h>
+#include "gpio.h"
+
+typedef int esp_err_t;
+#define ESP_OK 0
+
+typedef enum { TWAI_MODE_NORMAL, TWAI_MODE_NO_ACK, TWAI_MODE_LISTEN_ONLY } twai_mode_t;
+typedef struct
+{
+    twai_mode_t mode;
+    gpio_num_t tx_io, rx_io;
+    int clkout_io, bus_off_io;
+    uint32_t tx_queue_len, rx_queue_len, alerts_enabled, clkout_divider, intr_flags;
+} twai_general_config_t;
+typedef struct { uint32_t brp; uint8_t tseg_1, tseg_2, sjw; bool triple_sampling; } twai_timing_config_t;
+typedef struct { uint32_t acceptance_code, acceptance_mask; bool single_filter; } twai_filter_config_t;
+typedef struct
+{
+    int state;
+    uint32_t msgs_to_tx, msgs_to_rx, tx_error_counter, rx_error_counter, tx_failed_count;
+    uint32_t rx_missed_count, rx_overrun_count, arb_lost_count, bus_error_count;
+} twai_status_info_t;
+typedef struct
+{
+    uint32_t flags;
+    uint32_t identifier;
+    uint8_t data_length_code;
+    uint8_t data[8];
+} twai_message_t;
+
+#define TWAI_GENERAL_CONFIG_DEFAULT(tx, rx, m) {m, tx, rx, -1, -1, 5, 5, 0, 0, 0}
+#define TWAI_TIMING_CONFIG_500KBITS() {8, 15, 4, 3, false}
+#define TWAI_FILTER_CONFIG_ACCEPT_ALL() {0, 0xFFFFFFFF, true}
+
+#define TWAI_ALERT_TX_IDLE 0x0001
+#define TWAI_ALERT_TX_SUCCESS 0x0002
+#define TWAI_ALERT_TX_FAILED 0x0004
+#define TWAI_ALERT_BUS_ERROR 0x0008
+#define TWAI_ALERT_ERR_PASS 0x0010
+#define TWAI_ALERT_ERR_ACTIVE 0x0020
+#define TWAI_ALERT_BUS_OFF 0x0040
+#define TWAI_ALERT_BUS_RECOVERED 0x0080
+#define TWAI_ALERT_ARB_LOST 0x0100
+#define TWAI_ALERT_RX_QUEUE_FULL 0x0200
@@ -0,0 +1,22 @@
+//Host stand ins for the FreeRTOS types and critical sections, see ../Arduino.h
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xFFFFFFFFul
+
+//a spinlock, like portMUX on the ESP32 minus masking interrupts
+struct portMUX_TYPE
+{
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux) do { while ((mux)->flag.test_and_set(std::memory_order_acquire)) {} } while (0)
+#define portEXIT_CRITICAL(mux) (mux)->flag.clear(std::memory_order_release)
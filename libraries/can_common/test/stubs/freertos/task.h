@@ -0,0 +1,11 @@
+#pragma once
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+
+//every host thread counts as its own task
+inline TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    static thread_local char self;
+    return &self;
+}
@@ -0,0 +1,197 @@
+/*
+Host test for CAN_COMMON::watchForRange(id1, id2, maxFilters). Checks that the filters set
+let through exactly id1..id2 (no ID missing, none extra) for every 11 bit range and a few
+hundred thousand 29 bit ones, and the fallback, clamping and undo paths.
+
+Build and run from libraries/can_common:
+  g++ -std=gnu++17 -Itest/stubs -Isrc test/watch_for_range_test.cpp src/can_common.cpp -o watch_for_range_test && ./watch_for_range_test
+*/
+#include <stdio.h>
+#include "can_common.h"
+
+#define FAKE_FILTERS 32
+
+//Driver that only keeps track of its filters
+class FakeCAN : public CAN_COMMON
+{
+public:
+    struct { uint32_t id, mask; bool extended, configured; } filters[FAKE_FILTERS];
+    int failAfter; //refuse further filters once this many are set, -1 = never
+
+    FakeCAN(int numFilt) : CAN_COMMON(numFilt) { _init(); }
+
+    int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended)
+    {
+        if (mailbox >= numFilters) return -1;
+        filters[mailbox].id = id & mask;
+        filters[mailbox].mask = mask;
+        filters[mailbox].extended = extended;
+        filters[mailbox].configured = true;
+        return mailbox;
+    }
+    int _setFilter(uint32_t id, uint32_t mask, bool extended)
+    {
+        if (failAfter >= 0 && used() >= failAfter) return -1;
+        for (int i = 0; i < numFilters; i++)
+        {
+            if (!filters[i].configured) return _setFilterSpecific(i, id, mask, extended);
+        }
+        return -1;
+    }
+    int _clearFilter(uint8_t mailbox)
+    {
+        if (mailbox >= numFilters) return -1;
+        filters[mailbox].configured = false;
+        return mailbox;
+    }
+    void _init()
+    {
+        memset(filters, 0, sizeof(filters));
+        failAfter = -1;
+    }
+    int used()
+    {
+        int count = 0;
+        for (int i = 0; i < numFilters; i++) if (filters[i].configured) count++;
+        return count;
+    }
+    bool accepts(uint32_t id)
+    {
+        for (int i = 0; i < numFilters; i++)
+        {
+            if (filters[i].configured && (id & filters[i].mask) == filters[i].id) return true;
+        }
+        return false;
+    }
+
+    uint32_t init(uint32_t ul_baudrate) { return ul_baudrate; }
+    uint32_t beginAutoSpeed() { return 0; }
+    uint32_t set_baudrate(uint32_t ul_baudrate) { return ul_baudrate; }
+    void setListenOnlyMode(bool state) {}
+    void enable() {}
+    void disable() {}
+    bool sendFrame(CAN_FRAME& txFrame) { return false; }
+    bool rx_avail() { return false; }
+    uint16_t available() { return 0; }
+    uint32_t get_rx_buff(CAN_FRAME &msg) { return 0; }
+
+    using CAN_COMMON::_rangeBlocks;
+};
+
+static int failures = 0;
+
+#define CHECK(cond, lo, hi) do { if (!(cond)) { if (failures++ < 20) printf("FAIL %s for 0x%X..0x%X\n", #cond, (unsigned)(lo), (unsigned)(hi)); return; } } while (0)
+
+//Exact cover: every filter is one aligned block inside lo..hi, no two overlap and together
+//they are as large as the range. That is only possible if every ID is covered exactly once.
+static void checkRange(FakeCAN &can, uint32_t id1, uint32_t id2)
+{
+    uint32_t lo = (id1 < id2) ? id1 : id2, hi = (id1 < id2) ? id2 : id1;
+    uint32_t fullMask = (hi > 0x7FF) ? 0x1FFFFFFF : 0x7FF;
+    uint64_t total = 0;
+
+    can._init();
+    int count = can.watchForRange(id1, id2, FAKE_FILTERS);
+    if (FakeCAN::_rangeBlocks(lo, hi) > FAKE_FILTERS)
+    {
+        //can't be done exactly with the filters there are, one filter covering more instead
+        CHECK(count == 1 && can.used() == 1, lo, hi);
+        CHECK(can.accepts(lo) && can.accepts(hi), lo, hi);
+        return;
+    }
+    CHECK(count == FakeCAN::_rangeBlocks(lo, hi), lo, hi);
+    CHECK(count == can.used(), lo, hi);
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t first = can.filters[i].id, size = (~can.filters[i].mask & fullMask) + 1;
+        CHECK(can.filters[i].extended == (hi > 0x7FF), lo, hi);
+        CHECK((can.filters[i].mask & fullMask) == can.filters[i].mask, lo, hi);
+        CHECK((size & (size - 1)) == 0, lo, hi); //mask is a contiguous prefix
+        CHECK(first >= lo && first + (size - 1) <= hi, lo, hi);
+        for (int j = 0; j < i; j++)
+        {
+            uint32_t other = can.filters[j].id, otherSize = (~can.filters[j].mask & fullMask) + 1;
+            CHECK(first + (size - 1) < other || other + (otherSize - 1) < first, lo, hi);
+        }
+        total += size;
+    }
+    CHECK(total == (uint64_t)hi - lo + 1, lo, hi);
+    CHECK(can.accepts(lo) && can.accepts(hi), lo, hi);
+    CHECK(lo == 0 || !can.accepts(lo - 1), lo, hi);
+    CHECK(hi == fullMask || !can.accepts(hi + 1), lo, hi);
+}
+
+static uint32_t rng = 0x12345678;
+static uint32_t nextRandom()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+int main()
+{
+    FakeCAN can(FAKE_FILTERS);
+
+    //every standard range
+    for (uint32_t lo = 0; lo <= 0x7FF; lo++)
+        for (uint32_t hi = lo; hi <= 0x7FF; hi++) checkRange(can, lo, hi);
+    checkRange(can, 0x7FF, 0x100); //swapped arguments
+
+    //extended ranges, random and around the power of two boundaries
+    for (int i = 0; i < 200000; i++)
+    {
+        uint32_t a = nextRandom() & 0x1FFFFFFF, b = nextRandom() & 0x1FFFFFFF;
+        if (i & 1) b = a + (nextRandom() & 0xFFF); //short ranges too
+        if (b > 0x1FFFFFFF) b = 0x1FFFFFFF;
+        if (a < 0x800 && b < 0x800) continue;
+        checkRange(can, a, b);
+    }
+    for (int bit = 11; bit < 29; bit++)
+    {
+        uint32_t p = 1u << bit;
+        checkRange(can, p - 1, p);
+        checkRange(can, p, 0x1FFFFFFF);
+        checkRange(can, 0, p);
+        checkRange(can, 1, p - 2);
+    }
+    checkRange(can, 0, 0x1FFFFFFF);
+
+    //too many filters needed: one broader filter that still covers the range
+    can._init();
+    int result = can.watchForRange(0x101, 0x2FE, 3);
+    if (result != 1 || can.used() != 1 || !can.accepts(0x101) || !can.accepts(0x2FE))
+    {
+        printf("FAIL fallback returned %d with %d filters\n", result, can.used());
+        failures++;
+    }
+
+    //maxFilters larger than the driver has is clamped, so the same fallback happens
+    FakeCAN small(4);
+    result = small.watchForRange(0x101, 0x2FE, 30);
+    if (result != 1 || small.used() != 1)
+    {
+        printf("FAIL clamp returned %d with %d filters\n", result, small.used());
+        failures++;
+    }
+
+    //a filter that can't be set undoes the ones this call already set, earlier ones stay
+    can._init();
+    can.watchFor(0x7DF);
+    can.failAfter = 4;
+    result = can.watchForRange(0x101, 0x2FE, 20);
+    if (result != -1 || can.used() != 1 || !can.accepts(0x7DF) || can.accepts(0x101))
+    {
+        printf("FAIL undo returned %d with %d filters\n", result, can.used());
+        failures++;
+    }
+
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("watchForRange: all passed\n");
+    return 0;
+}
@@ -10,6 +10,7 @@
 
 // Buffer flush timing
 uint32_t lastFlushMicros = 0;
+uint32_t lastStatsLog = 0;
 
 EEPROMSettings settings;
 SystemSettings SysSettings;
@@ -65,6 +66,7 @@ void loadSettings()
 
         delay(100);
         CAN0.setCANPins(GPIO_NUM_4, GPIO_NUM_5); // shield pins
+        CAN0.setRXMode(ESP32_RX_RING);           // only the drain task reads CAN0
     }
 
     if (nvPrefs.getString("SSID", settings.SSID, 32) == 0)
@@ -97,11 +99,70 @@ void loadSettings()
         settings.canSettings[i].fdMode = nvPrefs.getBool(buff, false);
     }
 
+    memset(settings.rateLimits, 0, sizeof(settings.rateLimits));
+    nvPrefs.getBytes("ratelimits", settings.rateLimits, sizeof(settings.rateLimits));
+
     nvPrefs.end();
 
     Logger::setLoglevel((Logger::LogLevel)settings.logLevel);
 }
 
+// WiFi, Bluetooth and serial handling. Runs on the core that is not draining CAN frames.
+void task_Comm(void *pvParameters)
+{
+    while (1)
+    {
+        wifiManager.loop();
+
+        const size_t wifiLength = wifiGVRET.numAvailableBytes();
+        const size_t serialLength = serialGVRET.numAvailableBytes();
+        const size_t maxLength = (wifiLength > serialLength) ? wifiLength : serialLength;
+
+        // flush buffered data periodically or when buffers are nearly full
+        if ((micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) || (maxLength > (WIFI_BUFF_SIZE - 40)))
+        {
+            lastFlushMicros = micros();
+
+            if (serialLength > 0)
+            {
+                serialGVRET.drainTo(Serial);
+            }
+            if (wifiLength > 0)
+            {
+                wifiManager.sendBufferedData();
+            }
+        }
+
+        // pull serial bytes into GVRET in blocks. Keep going while input is waiting, up to
+        // a time budget, so a fast injection stream is not throttled to a fixed byte count.
+        uint32_t rxStart = micros();
+        int serialAvail;
+        while ((serialAvail = Serial.available()) > 0 && micros() - rxStart < SER_RX_BUDGET)
+        {
+            uint8_t rxBlock[SER_RX_BLOCK];
+            size_t got = Serial.readBytes(rxBlock, (serialAvail < SER_RX_BLOCK) ? serialAvail : SER_RX_BLOCK);
+            serialGVRET.processIncomingBytes(rxBlock, got);
+        }
+
+        // periodic loss / backlog summary for telnet users, never inside a binary stream
+        if (millis() - lastStatsLog > STATS_LOG_INTERVAL)
+        {
+            lastStatsLog = millis();
+            if (SysSettings.isWifiActive && !settings.useBinarySerialComm && Logger::getLogLevel() <= Logger::Info)
+                wifiGVRET.sendStatsLog();
+        }
+
+        // console output that is produced over several loops
+        serialGVRET.loop();
+        wifiGVRET.loop();
+
+        // ELM327 over BT or WiFi
+        elmEmulator.loop();
+
+        vTaskDelay(1); // let the idle task on this core run (task watchdog)
+    }
+}
+
 void setup()
 {
     Serial.begin(115200);
@@ -122,6 +183,13 @@ void setup()
     Serial.println();
 
     canManager.setup();
+
+    canManager.startTask();
+#if defined(CONFIG_FREERTOS_UNICORE)
+    xTaskCreate(task_Comm, "COMM", 8192, NULL, COMM_TASK_PRIORITY, NULL);
+#else
+    xTaskCreatePinnedToCore(task_Comm, "COMM", 8192, NULL, COMM_TASK_PRIORITY, NULL, COMM_TASK_CORE);
+#endif
 }
 
 /* Kept for compatibility with old headers; delete if you also remove the prototype. */
@@ -132,43 +200,12 @@ void sendMarkTriggered(int which)
     frame.extended = true;
     frame.length = 0;
     frame.rtr = 0;
+    frame.timestamp = micros();
     canManager.displayFrame(frame, 0);
 }
 
+// Everything happens in the CAN drain and comm tasks started by setup()
 void loop()
 {
-    canManager.loop();
-    wifiManager.loop();
-
-    const size_t wifiLength = wifiGVRET.numAvailableBytes();
-    const size_t serialLength = serialGVRET.numAvailableBytes();
-    const size_t maxLength = (wifiLength > serialLength) ? wifiLength : serialLength;
-
-    // flush buffered data periodically or when buffers are nearly full
-    if ((micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) || (maxLength > (WIFI_BUFF_SIZE - 40)))
-    {
-        lastFlushMicros = micros();
-
-        if (serialLength > 0)
-        {
-            Serial.write(serialGVRET.getBufferedBytes(), serialLength);
-            serialGVRET.clearBufferedBytes();
-        }
-        if (wifiLength > 0)
-        {
-            wifiManager.sendBufferedData();
-        }
-    }
-
-    // pull any serial bytes into GVRET
-    int serialCnt = 0;
-    while ((Serial.available() > 0) && serialCnt < 128)
-    {
-        serialCnt++;
-        const uint8_t in_byte = (uint8_t)Serial.read();
-        serialGVRET.processIncomingByte(in_byte);
-    }
-
-    // ELM327 over BT or WiFi
-    elmEmulator.loop();
+    vTaskDelete(NULL);
 }
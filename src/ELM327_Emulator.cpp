@@ -67,6 +67,10 @@ void ELM327Emu::sendCmd(String cmd)
 void ELM327Emu::loop()
 {
     int incoming;
+
+    // send replies queued by processCANReply() in the CAN drain task
+    sendTxBuffer();
+
     if (!mClient) // Bluetooth mode
     {
         while (serialBT.available())
@@ -129,18 +133,15 @@ void ELM327Emu::sendTxBuffer()
 {
     if (mClient)
     {
-        size_t wifiLength = txBuffer.numAvailableBytes();
-        uint8_t *buff = txBuffer.getBufferedBytes();
         if (mClient->connected())
-        {
-            mClient->write(buff, wifiLength);
-        }
+            txBuffer.drainTo(*mClient);
+        else
+            txBuffer.clearBufferedBytes();
     }
     else
     {
-        serialBT.write(txBuffer.getBufferedBytes(), txBuffer.numAvailableBytes());
+        txBuffer.drainTo(serialBT);
     }
-    txBuffer.clearBufferedBytes();
 }
 
 // Process a complete incoming AT or PID command string
@@ -288,7 +289,9 @@ String ELM327Emu::processELMCmd(char *cmd)
             outFrame.data.byte[3] = pidnum & 0xFF;
         }
 
-        canManager.sendFrame(&CAN0, outFrame);
+        // dropped by the driver (bus off, listen only, TX queue full): report it like a real ELM327
+        if (!canManager.sendFrame(0, outFrame))
+            retString.concat("CAN ERROR");
     }
 
     retString.concat(lineEnding);
@@ -315,5 +318,5 @@ void ELM327Emu::processCANReply(CAN_FRAME &frame)
         sprintf(buff, "%02X", frame.data.byte[1 + i]);
         txBuffer.sendString(buff);
     }
-    sendTxBuffer();
+    // only buffered here, loop() does the (possibly blocking) BT / WiFi write
 }
@@ -0,0 +1,62 @@
+#include "ascii_frame.h"
+
+static const char hexDigits[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                   '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+int AsciiFrame::appendHex(uint8_t *out, uint32_t v)
+{
+    int digits = 1;
+    while (digits < 8 && (v >> (digits * 4)))
+        digits++;
+    for (int i = digits - 1; i >= 0; i--)
+        out[digits - 1 - i] = hexDigits[(v >> (i * 4)) & 0xF];
+    return digits;
+}
+
+int AsciiFrame::appendDec(uint8_t *out, int32_t v)
+{
+    char tmp[10];
+    int n = 0;
+    int len = 0;
+    uint32_t u = (uint32_t)v;
+    if (v < 0)
+    {
+        out[len++] = '-';
+        u = 0u - u;
+    }
+    do
+    {
+        tmp[n++] = (char)('0' + (u % 10));
+        u /= 10;
+    } while (u);
+    while (n)
+        out[len++] = tmp[--n];
+    return len;
+}
+
+int AsciiFrame::encode(uint8_t *out, uint32_t stamp, uint32_t id, bool extended, int whichBus,
+                       uint8_t length, const uint8_t *data)
+{
+    int len = appendDec(out, (int32_t)stamp);
+    out[len++] = ' ';
+    out[len++] = '-';
+    out[len++] = ' ';
+    len += appendHex(&out[len], id);
+    out[len++] = ' ';
+    out[len++] = extended ? 'X' : 'S';
+    out[len++] = ' ';
+    len += appendDec(&out[len], whichBus);
+    out[len++] = ' ';
+    len += appendDec(&out[len], length);
+    for (int c = 0; c < length; c++)
+    {
+        uint8_t b = data[c];
+        out[len++] = ' ';
+        if (b > 0xF)
+            out[len++] = hexDigits[b >> 4];
+        out[len++] = hexDigits[b & 0xF];
+    }
+    out[len++] = '\r';
+    out[len++] = '\n';
+    return len;
+}
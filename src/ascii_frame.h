@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+/*
+GVRET ASCII frame lines: "<time> - <id> <X|S> <bus> <len> <data...>\r\n". Table driven
+replacement for the old per-field snprintf calls, the output is byte for byte what
+"%d - %x", " X "/" S ", "%i %i", " %x" per data byte and "\r\n" used to produce.
+*/
+class AsciiFrame
+{
+public:
+    // Encode one frame, returns the line length. out must hold MAX_ENCODED_FRAME_SIZE bytes.
+    static int encode(uint8_t *out, uint32_t stamp, uint32_t id, bool extended, int whichBus,
+                      uint8_t length, const uint8_t *data);
+    // Append a signed value in decimal (like "%d"), returns the number of characters
+    static int appendDec(uint8_t *out, int32_t v);
+    // Append a value as lowercase hex without leading zeros (like "%x")
+    static int appendHex(uint8_t *out, uint32_t v);
+};
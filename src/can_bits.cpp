@@ -0,0 +1,192 @@
+#include "can_bits.h"
+
+// Stuff run state: bit 3 = value of the last bit, bits 0-2 = how many times it repeated.
+// Before SOF the bus is recessive, SOF then starts a new run.
+#define STUFF_IDLE_STATE 0x08
+
+// (state << 8 | byte) -> stuff bits inserted << 4 | new state
+static uint8_t stuffTable[16 * 256];
+static uint16_t crcTable[256];
+
+// Bits of CRC delimiter, ACK slot, ACK delimiter, EOF and intermission
+#define FRAME_TAIL_BITS 13
+
+// Feed one bit through the stuffing rule, returns 1 if a stuff bit follows it
+static inline int _stuffBit(uint8_t &state, int bit)
+{
+    int last = state >> 3;
+    int run = state & 7;
+    run = (bit == last) ? run + 1 : 1;
+    if (run == 5)
+    {
+        state = (uint8_t)(((!bit) << 3) | 1); // the complementary stuff bit starts the next run
+        return 1;
+    }
+    state = (uint8_t)((bit << 3) | run);
+    return 0;
+}
+
+// MSB first bit writer
+static inline void _putBits(uint8_t *buff, int &pos, uint32_t value, int numBits)
+{
+    while (numBits--)
+    {
+        if ((value >> numBits) & 1)
+            buff[pos >> 3] |= (uint8_t)(0x80 >> (pos & 7));
+        pos++;
+    }
+}
+
+static inline int _getBit(const uint8_t *buff, int pos)
+{
+    return (buff[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+void CANBits::init()
+{
+    for (int s = 0; s < 16; s++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint8_t state = (uint8_t)s;
+            int count = 0;
+            for (int i = 7; i >= 0; i--)
+                count += _stuffBit(state, (b >> i) & 1);
+            stuffTable[(s << 8) | b] = (uint8_t)((count << 4) | state);
+        }
+    }
+
+    for (int b = 0; b < 256; b++)
+    {
+        uint16_t crc = (uint16_t)(b << 7);
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x4000) ? (uint16_t)(((crc << 1) ^ 0x4599) & 0x7FFF) : (uint16_t)((crc << 1) & 0x7FFF);
+        crcTable[b] = crc;
+    }
+}
+
+int CANBits::countStuffBits(const uint8_t *buff, int start, int end, uint8_t &state)
+{
+    int count = 0;
+    int pos = start;
+
+    while (pos < end && (pos & 7))
+        count += _stuffBit(state, _getBit(buff, pos++));
+    while (pos + 8 <= end)
+    {
+        uint8_t entry = stuffTable[(state << 8) | buff[pos >> 3]];
+        count += entry >> 4;
+        state = entry & 0x0F;
+        pos += 8;
+    }
+    while (pos < end)
+        count += _stuffBit(state, _getBit(buff, pos++));
+    return count;
+}
+
+// CAN CRC-15 (polynomial 0x4599) over the first numBits bits of buff
+uint16_t CANBits::crc15(const uint8_t *buff, int numBits)
+{
+    uint16_t crc = 0;
+    int pos = 0;
+    for (; pos + 8 <= numBits; pos += 8)
+        crc = (uint16_t)(((crc << 8) & 0x7FFF) ^ crcTable[((crc >> 7) ^ buff[pos >> 3]) & 0xFF]);
+    for (; pos < numBits; pos++)
+    {
+        int bit = _getBit(buff, pos) ^ (crc >> 14);
+        crc = (uint16_t)((crc << 1) & 0x7FFF);
+        if (bit)
+            crc ^= 0x4599;
+    }
+    return crc;
+}
+
+void CANBits::classicFrame(uint32_t id, bool extended, bool rtr, uint8_t length, const uint8_t *data, FRAME_BITS &bits)
+{
+    uint8_t buff[16] = {0};
+    int pos = 0;
+
+    if (length > 8)
+        length = 8;
+
+    pos++; // SOF (dominant)
+    if (extended)
+    {
+        _putBits(buff, pos, id >> 18, 11);
+        _putBits(buff, pos, 3, 2); // SRR, IDE
+        _putBits(buff, pos, id, 18);
+        _putBits(buff, pos, rtr ? 1 : 0, 1);
+        pos += 2; // r1, r0
+    }
+    else
+    {
+        _putBits(buff, pos, id, 11);
+        _putBits(buff, pos, rtr ? 1 : 0, 1);
+        pos += 2; // IDE, r0
+    }
+    _putBits(buff, pos, length, 4);
+    if (!rtr)
+    {
+        for (int i = 0; i < length; i++)
+            _putBits(buff, pos, data[i], 8);
+    }
+    _putBits(buff, pos, crc15(buff, pos), 15);
+
+    uint8_t state = STUFF_IDLE_STATE;
+    bits.arbitrationBits = (uint16_t)(pos + countStuffBits(buff, 0, pos, state) + FRAME_TAIL_BITS);
+    bits.dataBits = 0;
+}
+
+void CANBits::fdFrame(uint32_t id, bool extended, bool bitRateSwitch, uint8_t length, const uint8_t *data, FRAME_BITS &bits)
+{
+    static const uint8_t fdSizes[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+    uint8_t buff[80] = {0};
+    int pos = 0;
+
+    // round up to the next size a DLC can express, the padding is sent too
+    uint8_t dlc = 0;
+    while (dlc < 15 && fdSizes[dlc] < length)
+        dlc++;
+    int numBytes = fdSizes[dlc];
+
+    pos++; // SOF
+    if (extended)
+    {
+        _putBits(buff, pos, id >> 18, 11);
+        _putBits(buff, pos, 3, 2); // SRR, IDE
+        _putBits(buff, pos, id, 18);
+    }
+    else
+    {
+        _putBits(buff, pos, id, 11);
+        pos++; // IDE
+    }
+    pos++;                      // RRS
+    _putBits(buff, pos, 1, 1);  // FDF
+    pos++;                      // res
+    _putBits(buff, pos, bitRateSwitch ? 1 : 0, 1);
+    int switchPos = pos; // data phase starts after the BRS bit
+    pos++;               // ESI (error active)
+    _putBits(buff, pos, dlc, 4);
+    for (int i = 0; i < numBytes; i++)
+        _putBits(buff, pos, (i < length) ? data[i] : 0xCC, 8);
+
+    // stuff count (4) + CRC-17 or CRC-21, with a fixed stuff bit before the field and after every 4th bit
+    int crcBits = (numBytes <= 16) ? (4 + 17 + 6) : (4 + 21 + 7);
+
+    uint8_t state = STUFF_IDLE_STATE;
+    int arbitration = switchPos + countStuffBits(buff, 0, switchPos, state);
+    int dataPhase = (pos - switchPos) + countStuffBits(buff, switchPos, pos, state) + crcBits + 1; // + CRC delimiter
+    arbitration += FRAME_TAIL_BITS - 1;
+
+    if (bitRateSwitch)
+    {
+        bits.arbitrationBits = (uint16_t)arbitration;
+        bits.dataBits = (uint16_t)dataPhase;
+    }
+    else
+    {
+        bits.arbitrationBits = (uint16_t)(arbitration + dataPhase);
+        bits.dataBits = 0;
+    }
+}
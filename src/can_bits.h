@@ -0,0 +1,30 @@
+#pragma once
+#include <Arduino.h>
+
+// Length of one frame on the wire, split by the bit rate it is sent with
+struct FRAME_BITS
+{
+    uint16_t arbitrationBits; // nominal bit rate (everything for classic frames)
+    uint16_t dataBits;        // CAN-FD data phase, only when the bit rate is switched
+};
+
+/*
+Exact on-the-wire length of CAN frames including stuff bits, CRC and the interframe
+space. The frame is laid out into a bit buffer and the dynamic stuff bits are counted
+a byte at a time through a table indexed by (run state, next byte). Classic frames
+need the real CRC-15 since the CRC field is stuffed too, the CAN-FD CRC field uses
+fixed stuff bits so its length does not depend on the value.
+*/
+class CANBits
+{
+public:
+    // Builds the lookup tables. Call once before the first frame is measured, before any
+    // task that measures frames runs.
+    static void init();
+    static void classicFrame(uint32_t id, bool extended, bool rtr, uint8_t length, const uint8_t *data, FRAME_BITS &bits);
+    static void fdFrame(uint32_t id, bool extended, bool bitRateSwitch, uint8_t length, const uint8_t *data, FRAME_BITS &bits);
+
+private:
+    static int countStuffBits(const uint8_t *buff, int start, int end, uint8_t &state);
+    static uint16_t crc15(const uint8_t *buff, int numBits);
+};
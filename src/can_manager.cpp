@@ -4,6 +4,7 @@
 #include "config.h"
 #include "gvret_comm.h"
 #include "ELM327_Emulator.h"
+#include "can_bits.h"
 
 // Set a given LED pin HIGH or LOW
 static void setLED(uint8_t which, boolean hi)
@@ -39,13 +40,221 @@ static void toggleTXLED()
 }
 // --- end LED helpers ---
 
+#define RULE_NONE 0xFF    // no rate limit matches this ID
+#define RULE_UNKNOWN 0xFE // not looked up since the rules last changed
+
 CANManager::CANManager()
 {
+    changeState = NULL;
+    heartbeatInterval = 0;
+    memset(slotRule, RULE_UNKNOWN, sizeof(slotRule));
+    drainTask = NULL;
+    busMutex = NULL;
+    busWaiters = 0;
+    forwardQueue = NULL;
+    lastDrainPass = 0;
+    maxServiceGap = 0;
+    maxQueueDepth = 0;
+    txHead = 0;
+    txTail = 0;
+    txDue = 0;
+    txOwner = NULL;
+    txHanded = 0;
+    txSent = 0;
+    txFailed = 0;
+    txBaseSent = 0;
+    txReportDue = false;
+}
+
+// Select between forwarding every frame (default) and forwarding a frame only when its
+// payload differs from the last one forwarded for that ID or heartbeatMs have passed.
+// Starts over with an empty ID table, so the next frame of every ID passes.
+void CANManager::setForwardMode(bool onChangeOnly, uint16_t heartbeatMs)
+{
+    lockBuses();
+    heartbeatInterval = heartbeatMs;
+    if (onChangeOnly && !changeState)
+        changeState = new CHANGE_STATE;
+    else if (!onChangeOnly && changeState)
+    {
+        delete changeState;
+        changeState = NULL;
+    }
+    resetIDs();
+    unlockBuses();
+}
+
+// Forget every ID: hand out the table slots again and reset all per slot state. The
+// caller keeps the drain task out.
+void CANManager::resetIDs()
+{
+    portENTER_CRITICAL(&idStatsLock);
+    idTable.clear();
+    idStats.clear();
+    portEXIT_CRITICAL(&idStatsLock);
+    if (changeState)
+        memset(changeState->lastLength, 0xFF, sizeof(changeState->lastLength));
+    memset(slotRule, RULE_UNKNOWN, sizeof(slotRule));
+}
+
+// Replace one rate limit rule and store the rule set in flash. The drain task reads the
+// rules and the per slot state in shouldForward, so it is kept out while they change.
+void CANManager::setRateLimit(uint8_t index, RATE_LIMIT &rule)
+{
+    if (index >= MAX_RATE_LIMITS)
+        return;
+    lockBuses();
+    settings.rateLimits[index] = rule;
+    memset(slotRule, RULE_UNKNOWN, sizeof(slotRule));
+    unlockBuses();
+    saveRateLimits();
+}
+
+void CANManager::clearRateLimits()
+{
+    lockBuses();
+    memset(settings.rateLimits, 0, sizeof(settings.rateLimits));
+    memset(slotRule, RULE_UNKNOWN, sizeof(slotRule));
+    unlockBuses();
+    saveRateLimits();
+}
+
+void CANManager::saveRateLimits()
+{
+    nvPrefs.begin(PREF_NAME, false);
+    nvPrefs.putBytes("ratelimits", settings.rateLimits, sizeof(settings.rateLimits));
+    nvPrefs.end();
+}
+
+// Compare by value for classic payloads, FD payloads through a 64 bit FNV-1a hash
+void CANManager::makeFingerprint(uint8_t length, const uint8_t *data, uint8_t *fingerprint)
+{
+    if (length <= 8)
+    {
+        memset(fingerprint, 0, 8);
+        memcpy(fingerprint, data, length);
+    }
+    else
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (int i = 0; i < length; i++)
+            hash = (hash ^ data[i]) * 1099511628211ull;
+        memcpy(fingerprint, &hash, 8);
+    }
+}
+
+// First enabled rule covering the ID in this slot. Done once per ID, not per frame.
+int CANManager::findRateLimit(int slot)
+{
+    uint32_t id = idTable.getID(slot);
+    uint8_t ext = idTable.isExtended(slot) ? RATE_LIMIT_EXTENDED : 0;
+    int bus = idTable.getBus(slot);
+
+    for (int r = 0; r < MAX_RATE_LIMITS; r++)
+    {
+        RATE_LIMIT &rule = settings.rateLimits[r];
+        if (!(rule.flags & RATE_LIMIT_ENABLED))
+            continue;
+        if ((rule.flags & RATE_LIMIT_EXTENDED) != ext)
+            continue;
+        if (rule.bus != 0xFF && rule.bus != bus)
+            continue;
+        if (id >= rule.idLow && id <= rule.idHigh)
+            return r;
+    }
+    return RULE_NONE;
+}
+
+// Token bucket: refills at maxRate frames per second and holds up to a quarter second
+// worth of frames (at least one) so bursts are smoothed without starving slow IDs.
+bool CANManager::takeToken(int slot)
+{
+    RATE_LIMIT &rule = settings.rateLimits[slotRule[slot]];
+    uint32_t now = millis();
+
+    if (rule.maxRate == 0)
+        return false;
+
+    uint32_t capacity = (rule.maxRate >= 4) ? (rule.maxRate / 4) * 1000 : 1000;
+    uint32_t elapsed = now - slotRefill[slot];
+    slotRefill[slot] = now;
+    if (elapsed >= 1000)
+        slotTokens[slot] = capacity;
+    else
+    {
+        slotTokens[slot] += elapsed * rule.maxRate; // 1 frame per second = 1/1000 frame per ms
+        if (slotTokens[slot] > capacity)
+            slotTokens[slot] = capacity;
+    }
+
+    if (slotTokens[slot] < 1000)
+        return false;
+    slotTokens[slot] -= 1000;
+    return true;
+}
+
+// Apply "on change" forwarding and rate limits. Only frames that are actually forwarded
+// update the change state and use up rate tokens.
+bool CANManager::shouldForward(int slot, uint8_t length, const uint8_t *data)
+{
+    if (slot < 0)
+        return true; // table full: never hide traffic we cannot track
+
+    uint8_t fingerprint[8];
+    uint32_t now = millis();
+    if (changeState)
+    {
+        makeFingerprint(length, data, fingerprint);
+        if (changeState->lastLength[slot] == length && memcmp(changeState->lastPayload[slot], fingerprint, 8) == 0 &&
+            (heartbeatInterval == 0 || (now - changeState->lastForwardTime[slot]) < heartbeatInterval))
+            return false;
+    }
+
+    if (slotRule[slot] == RULE_UNKNOWN)
+    {
+        slotRule[slot] = findRateLimit(slot);
+        slotTokens[slot] = 1000; // let the first frame of a newly limited ID through
+        slotRefill[slot] = now;
+    }
+    if (slotRule[slot] != RULE_NONE && !takeToken(slot))
+        return false;
+
+    if (changeState)
+    {
+        memcpy(changeState->lastPayload[slot], fingerprint, 8);
+        changeState->lastLength[slot] = length;
+        changeState->lastForwardTime[slot] = now;
+    }
+    return true;
+}
+
+int CANManager::getIDCount()
+{
+    return idTable.count();
+}
+
+// Consistent copy of one entry: the drain task updates several words of it per frame
+bool CANManager::getIDStat(int slot, ID_STAT &stat)
+{
+    portENTER_CRITICAL(&idStatsLock);
+    bool found = idStats.get(idTable, slot, stat);
+    portEXIT_CRITICAL(&idStatsLock);
+    return found;
+}
+
+// Also frees the table slots of IDs that are gone, so new ones can be tracked again
+void CANManager::clearIDStats()
+{
+    lockBuses();
+    resetIDs();
+    unlockBuses();
 }
 
 // Initialize CAN buses and related parameters
 void CANManager::setup()
 {
+    CANBits::init(); // before the drain task or a send measures a frame
+
     for (int i = 0; i < SysSettings.numBuses; i++)
     {
         if (settings.canSettings[i].enabled)
@@ -85,6 +294,7 @@ void CANManager::setup()
                 canBuses[i]->setListenOnlyMode(false);
 
             canBuses[i]->watchFor(); // accept all frames by default
+            canBuses[i]->applyFilters();
         }
         else
         {
@@ -109,65 +319,357 @@ void CANManager::setup()
     }
 
     // Initialize bus load tracking
-    for (int j = 0; j < NUM_BUSES; j++)
+    memset(busLoad, 0, sizeof(busLoad));
+    busLoadTimer = millis();
+
+    if (!busMutex)
+        busMutex = xSemaphoreCreateMutex();
+}
+
+// Move frame draining out of the Arduino loop into its own task next to the driver
+void CANManager::startTask()
+{
+    if (drainTask)
+        return;
+    forwardQueue = xQueueCreate(FORWARD_QUEUE_SIZE, sizeof(FORWARD_REQUEST));
+#if defined(CONFIG_FREERTOS_UNICORE)
+    xTaskCreate(CANManager::task_Drain, "CAN_DRAIN", 4096, this, CAN_DRAIN_PRIORITY, &drainTask);
+#else
+    xTaskCreatePinnedToCore(CANManager::task_Drain, "CAN_DRAIN", 4096, this, CAN_DRAIN_PRIORITY, &drainTask, CAN_DRAIN_CORE);
+#endif
+    CommBuffer::setFrameProducer(drainTask); // frames get their own ring in every output buffer
+    CAN0.setRXNotify(drainTask); // wake up as soon as the built in bus has frames
+}
+
+// Drains the driver queues into the output buffers. Sleeps for up to a tick whenever a pass
+// found nothing to do (or the output buffers were full) so lower priority tasks can run.
+// The built in bus notifies us when it gets a frame, other buses are just polled.
+// Giving the mutex back does not hand it to a waiting lower priority task, so under
+// constant traffic we would take it again straight away; while someone waits in
+// lockBuses() we sleep a tick instead and block on the mutex once they have it.
+void CANManager::task_Drain(void *pvParameters)
+{
+    CANManager *manager = (CANManager *)pvParameters;
+
+    while (1)
     {
-        busLoad[j].bitsPerQuarter = settings.canSettings[j].nomSpeed / 4;
-        busLoad[j].bitsSoFar = 0;
-        busLoad[j].busloadPercentage = 0;
-        if (busLoad[j].bitsPerQuarter == 0)
-            busLoad[j].bitsPerQuarter = 125000; // fail-safe default
+        if (manager->busWaiters.load())
+        {
+            vTaskDelay(1);
+            continue;
+        }
+        xSemaphoreTake(manager->busMutex, portMAX_DELAY);
+        int frames = manager->loop();
+        xSemaphoreGive(manager->busMutex);
+        if (frames == 0)
+            ulTaskNotifyTake(pdTRUE, 1);
     }
+}
 
-    busLoadTimer = millis();
+// Keep the drain task away from the buses while they are being reconfigured
+void CANManager::lockBuses()
+{
+    if (!busMutex)
+        return;
+    busWaiters++;
+    xSemaphoreTake(busMutex, portMAX_DELAY);
+    busWaiters--;
+}
+
+void CANManager::unlockBuses()
+{
+    if (busMutex)
+        xSemaphoreGive(busMutex);
 }
 
-// Accumulate bit count for classic CAN frame
+uint32_t CANManager::getMaxServiceGap()
+{
+    return maxServiceGap;
+}
+
+int CANManager::getMaxQueueDepth()
+{
+    return maxQueueDepth;
+}
+
+void CANManager::resetDrainStats()
+{
+    maxServiceGap = 0;
+    maxQueueDepth = 0;
+}
+
+// Accumulate the exact (stuffed) bit count of a classic CAN frame
 void CANManager::addBits(int offset, CAN_FRAME &frame)
 {
     if (offset < 0 || offset >= NUM_BUSES)
         return;
-    busLoad[offset].bitsSoFar += 41 + (frame.length * 9); // base frame overhead + data
-    if (frame.extended)
-        busLoad[offset].bitsSoFar += 18; // extra bits for extended ID
+    FRAME_BITS bits;
+    CANBits::classicFrame(frame.id, frame.extended, frame.rtr, frame.length, frame.data.uint8, bits);
+    portENTER_CRITICAL(&busLoadLock);
+    busLoad[offset].arbitrationBits += bits.arbitrationBits;
+    portEXIT_CRITICAL(&busLoadLock);
 }
 
-// Accumulate bit count for CAN FD frame
+// Accumulate the exact bit count of a frame on an FD capable bus. FD frames are assumed
+// to switch to the data bit rate whenever one faster than the nominal rate is configured.
 void CANManager::addBits(int offset, CAN_FRAME_FD &frame)
 {
     if (offset < 0 || offset >= NUM_BUSES)
         return;
-    busLoad[offset].bitsSoFar += 41 + (frame.length * 9);
-    if (frame.extended)
-        busLoad[offset].bitsSoFar += 18;
+    FRAME_BITS bits;
+    if (frame.fdMode)
+    {
+        bool brs = settings.canSettings[offset].fdSpeed > settings.canSettings[offset].nomSpeed;
+        CANBits::fdFrame(frame.id, frame.extended, brs, frame.length, frame.data.uint8, bits);
+    }
+    else
+        CANBits::classicFrame(frame.id, frame.extended, false, frame.length, frame.data.uint8, bits);
+    portENTER_CRITICAL(&busLoadLock);
+    busLoad[offset].arbitrationBits += bits.arbitrationBits;
+    busLoad[offset].dataBits += bits.dataBits;
+    portEXIT_CRITICAL(&busLoadLock);
 }
 
-// Send classic CAN frame on specified bus and blink TX LED
-void CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME &frame)
+// Turn the bits counted since the last update into the time the bus was busy
+void CANManager::updateBusLoad()
+{
+    uint32_t now = millis();
+    uint32_t elapsed = now - busLoadTimer;
+    busLoadTimer = now;
+
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        BUSLOAD &load = busLoad[i];
+        portENTER_CRITICAL(&busLoadLock);
+        uint32_t arbitrationBits = load.arbitrationBits;
+        uint32_t dataBits = load.dataBits;
+        load.arbitrationBits = 0;
+        load.dataBits = 0;
+        portEXIT_CRITICAL(&busLoadLock);
+
+        uint32_t nomSpeed = settings.canSettings[i].nomSpeed;
+        uint32_t dataSpeed = settings.canSettings[i].fdSpeed;
+        if (nomSpeed == 0)
+            nomSpeed = 500000; // fail-safe default
+        if (dataSpeed == 0)
+            dataSpeed = nomSpeed;
+
+        // busy time in us, divided by the interval in ms gives tenths of a percent
+        uint64_t busyMicros = ((uint64_t)arbitrationBits * 1000000ull) / nomSpeed +
+                              ((uint64_t)dataBits * 1000000ull) / dataSpeed;
+        uint32_t instant = (elapsed > 0) ? (uint32_t)(busyMicros / elapsed) : 0;
+        if (instant > 1000)
+            instant = 1000;
+
+        load.instantLoad = (uint16_t)instant;
+        load.averageLoad = (uint16_t)((load.averageLoad * 3 + instant) / 4);
+        // Minimum 0.1% if there was any traffic
+        if (load.averageLoad == 0 && (arbitrationBits | dataBits))
+            load.averageLoad = 1;
+        if (load.instantLoad > load.peakLoad)
+            load.peakLoad = load.instantLoad;
+    }
+}
+
+uint16_t CANManager::getBusLoad(int whichBus)
+{
+    return (whichBus >= 0 && whichBus < NUM_BUSES) ? busLoad[whichBus].averageLoad : 0;
+}
+
+uint16_t CANManager::getBusLoadInstant(int whichBus)
+{
+    return (whichBus >= 0 && whichBus < NUM_BUSES) ? busLoad[whichBus].instantLoad : 0;
+}
+
+uint16_t CANManager::getBusLoadPeak(int whichBus)
+{
+    return (whichBus >= 0 && whichBus < NUM_BUSES) ? busLoad[whichBus].peakLoad : 0;
+}
+
+void CANManager::resetBusLoadPeak()
 {
-    int whichBus = 0;
     for (int i = 0; i < NUM_BUSES; i++)
-        if (canBuses[i] == bus)
-            whichBus = i;
-    bus->sendFrame(frame);
-    addBits(whichBus, frame);
-    toggleTXLED();
+        busLoad[i].peakLoad = 0;
+}
+
+// Send classic CAN frame on specified bus and blink TX LED
+bool CANManager::sendFrame(int whichBus, CAN_FRAME &frame)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !canBuses[whichBus])
+        return false;
+    bool sent = canBuses[whichBus]->sendFrame(frame);
+    if (sent)
+    {
+        addBits(whichBus, frame);
+        toggleTXLED();
+    }
+    return sent;
 }
 
 // Send CAN FD frame on specified bus and blink TX LED
-void CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame)
+bool CANManager::sendFrame(int whichBus, CAN_FRAME_FD &frame)
 {
-    int whichBus = 0;
-    for (int i = 0; i < NUM_BUSES; i++)
-        if (canBuses[i] == bus)
-            whichBus = i;
-    bus->sendFrameFD(frame);
-    addBits(whichBus, frame);
-    toggleTXLED();
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !canBuses[whichBus])
+        return false;
+    bool sent = canBuses[whichBus]->sendFrameFD(frame);
+    if (sent)
+    {
+        addBits(whichBus, frame);
+        toggleTXLED();
+    }
+    return sent;
 }
 
-// Send a received classic CAN frame to the correct output buffer
+// Queue a frame of a PROTO_BULK_TX sequence from link. It goes out delayUs after the previous
+// frame of the sequence, or after now if nothing is waiting. False if the schedule is full or
+// still busy with a sequence of the other link.
+bool CANManager::scheduleFrame(int whichBus, CAN_FRAME &frame, uint32_t delayUs, const GVRET_Comm_Handler *link)
+{
+    ESP32_DRIVER_STATS stats;
+    uint32_t baseSent = 0;
+
+    if (whichBus < 0 || whichBus >= SysSettings.numBuses || !canBuses[whichBus])
+        return false;
+
+    // where the built in bus counters stand before the first frame of a new sequence can go out.
+    // Only frames for CAN0 are accounted through its counters (see serviceSchedule), but any
+    // later frame of the sequence may be one, so take the snapshot whatever bus this one is for.
+    portENTER_CRITICAL(&txScheduleLock);
+    bool starting = (txOwner == NULL);
+    portEXIT_CRITICAL(&txScheduleLock);
+    if (starting)
+    {
+        CAN0.getDriverStats(stats);
+        baseSent = stats.txSent;
+    }
+
+    portENTER_CRITICAL(&txScheduleLock);
+    if ((txOwner && txOwner != link) || txHead - txTail >= TX_SCHEDULE_SIZE)
+    {
+        portEXIT_CRITICAL(&txScheduleLock);
+        return false;
+    }
+    if (txOwner == NULL)
+    {
+        txOwner = link;
+        txHanded = 0;
+        txSent = 0;
+        txFailed = 0;
+        txBaseSent = baseSent;
+    }
+    bool wasEmpty = (txHead == txTail);
+    TX_SCHEDULED &entry = txSchedule[txHead & (TX_SCHEDULE_SIZE - 1)];
+    entry.frame = frame;
+    entry.delay = delayUs;
+    entry.bus = (uint8_t)whichBus;
+    if (wasEmpty)
+        txDue = micros() + delayUs;
+    txHead++;
+    portEXIT_CRITICAL(&txScheduleLock);
+
+    if (wasEmpty && drainTask)
+        xTaskNotifyGive(drainTask);
+    return true;
+}
+
+// Schedule slots link can use right now, none while the other link's sequence runs
+int CANManager::getScheduleFree(const GVRET_Comm_Handler *link)
+{
+    portENTER_CRITICAL(&txScheduleLock);
+    int used = txHead - txTail;
+    bool busy = (txOwner && txOwner != link);
+    portEXIT_CRITICAL(&txScheduleLock);
+    return busy ? 0 : TX_SCHEDULE_SIZE - used;
+}
+
+// Once link's sequence is over, all frames sent and none of them still on its way out of
+// the built in bus: hand out how many got onto the bus and how many failed, and free the
+// schedule for the next sequence. False while frames are still waiting, for another link
+// or when already reported. The built in bus only counts completions for all its traffic,
+// so other frames finishing meanwhile can hide failures of the sequence, never add to it.
+// Reading CAN0 is right whatever buses the sequence used: handed only counts frames that
+// went to CAN0, frames for other buses were counted when their driver took them.
+bool CANManager::takeScheduleReport(const GVRET_Comm_Handler *link, uint32_t &sent, uint32_t &failed)
+{
+    ESP32_DRIVER_STATS stats;
+
+    portENTER_CRITICAL(&txScheduleLock);
+    bool due = txOwner == link && txReportDue && txHead == txTail;
+    uint32_t handed = txHanded;
+    portEXIT_CRITICAL(&txScheduleLock);
+    if (!due)
+        return false;
+
+    uint32_t onBus = 0;
+    if (handed)
+    {
+        if (CAN0.txInFlight())
+            return false;
+        CAN0.getDriverStats(stats);
+        onBus = stats.txSent - txBaseSent;
+        if (onBus > handed)
+            onBus = handed;
+    }
+
+    portENTER_CRITICAL(&txScheduleLock);
+    sent = txSent + onBus;
+    failed = txFailed + (handed - onBus);
+    txOwner = NULL;
+    txReportDue = false;
+    portEXIT_CRITICAL(&txScheduleLock);
+    return true;
+}
+
+// Drain task side of the schedule: send the frames that are due. Only this task advances
+// txTail, so the entry can be sent outside of the lock.
+void CANManager::serviceSchedule()
+{
+    for (int n = 0; n < TX_SCHEDULE_BURST; n++)
+    {
+        portENTER_CRITICAL(&txScheduleLock);
+        bool due = (txHead != txTail) && (int32_t)(micros() - txDue) >= 0;
+        portEXIT_CRITICAL(&txScheduleLock);
+        if (!due)
+            return;
+
+        TX_SCHEDULED &entry = txSchedule[txTail & (TX_SCHEDULE_SIZE - 1)];
+        // built in bus: wait for room instead of having the driver refuse the frame
+        bool builtIn = (canBuses[entry.bus] == &CAN0);
+        if (builtIn && settings.canSettings[entry.bus].enabled && CAN0.txQueueSpace() == 0)
+            return;
+        bool sent = sendFrame(entry.bus, entry.frame);
+
+        portENTER_CRITICAL(&txScheduleLock);
+        if (!sent)
+            txFailed++;
+        else if (builtIn)
+            txHanded++; // counted once the driver knows whether it went out
+        else
+            txSent++; // other drivers can't tell, taking the frame is all we learn
+        txTail++;
+        // step from the previous due time, not from now, so a late pass does not shift the rest
+        if (txHead != txTail)
+            txDue += txSchedule[txTail & (TX_SCHEDULE_SIZE - 1)].delay;
+        else
+            txReportDue = true;
+        portEXIT_CRITICAL(&txScheduleLock);
+    }
+}
+
+// Send a received classic CAN frame to the correct output buffer. Frames from other tasks
+// (echoed host frames, marks) are handed to the drain task, the only one encoding frames.
 void CANManager::displayFrame(CAN_FRAME &frame, int whichBus)
 {
+    if (drainTask && xTaskGetCurrentTaskHandle() != drainTask)
+    {
+        FORWARD_REQUEST request;
+        request.frame = frame;
+        request.bus = (uint8_t)whichBus;
+        if (xQueueSend(forwardQueue, &request, 0) == pdTRUE)
+            xTaskNotifyGive(drainTask);
+        return;
+    }
+
     if (SysSettings.isWifiActive)
         wifiGVRET.sendFrameToBuffer(frame, whichBus);
     else
@@ -183,32 +685,93 @@ void CANManager::displayFrame(CAN_FRAME_FD &frame, int whichBus)
         serialGVRET.sendFrameToBuffer(frame, whichBus);
 }
 
-// Main loop: poll CAN buses, forward frames, track bus load
-void CANManager::loop()
+void CANManager::displayErrorEvent(ESP32_ERROR_EVENT &event, int whichBus)
 {
-    CAN_FRAME incoming;
-    CAN_FRAME_FD inFD;
+    if (SysSettings.isWifiActive)
+        wifiGVRET.sendErrorEventToBuffer(event, whichBus);
+    else
+        serialGVRET.sendErrorEventToBuffer(event, whichBus);
+}
 
-    // Track current output buffer usage (wifi vs serial)
-    size_t wifiLength = wifiGVRET.numAvailableBytes();
-    size_t serialLength = serialGVRET.numAvailableBytes();
-    size_t maxLength = (wifiLength > serialLength) ? wifiLength : serialLength;
+// Statistics, filtering and forwarding for one received classic frame
+void CANManager::processFrame(CAN_FRAME &frame, int whichBus)
+{
+    addBits(whichBus, frame);
+    int slot = idTable.findOrAdd(frame.id, frame.extended, whichBus);
+    if (slot >= 0)
+    {
+        portENTER_CRITICAL(&idStatsLock);
+        idStats.update(slot, frame.timestamp, frame.length, frame.data.uint8);
+        portEXIT_CRITICAL(&idStatsLock);
+    }
+    if (shouldForward(slot, frame.length, frame.data.uint8))
+        displayFrame(frame, whichBus);
 
-    // Every 250ms, calculate bus load percentage and reset counter
-    if (millis() > (busLoadTimer + 250))
+    // Forward certain frames to ELM327 emulator
+    if ((frame.id > 0x7DF && frame.id < 0x7F0) || elmEmulator.getMonitorMode())
     {
-        busLoadTimer = millis();
-        busLoad[0].busloadPercentage =
-            ((busLoad[0].busloadPercentage * 3) +
-             (((busLoad[0].bitsSoFar * 1000) / busLoad[0].bitsPerQuarter) / 10)) /
-            4;
+        elmEmulator.processCANReply(frame);
+    }
+    toggleRXLED(); // blink RX LED on any received frame
+}
+
+// Same for a frame from a bus running in FD mode
+void CANManager::processFrame(CAN_FRAME_FD &frame, int whichBus)
+{
+    addBits(whichBus, frame);
+    int slot = idTable.findOrAdd(frame.id, frame.extended, whichBus);
+    if (slot >= 0)
+    {
+        portENTER_CRITICAL(&idStatsLock);
+        idStats.update(slot, frame.timestamp, frame.length, frame.data.uint8);
+        portEXIT_CRITICAL(&idStatsLock);
+    }
+    if (shouldForward(slot, frame.length, frame.data.uint8))
+        displayFrame(frame, whichBus);
+    toggleRXLED();
+}
+
+// One drain pass: poll CAN buses, forward frames, track bus load. Returns the number of frames read.
+int CANManager::loop()
+{
+    int frames = 0;
+
+    uint32_t now = micros();
+    if (lastDrainPass && (now - lastDrainPass) > maxServiceGap)
+        maxServiceGap = now - lastDrainPass;
+    lastDrainPass = now;
+
+    // Track free space in the output rings (wifi vs serial)
+    size_t wifiFree = wifiGVRET.numFreeBytes();
+    size_t serialFree = serialGVRET.numFreeBytes();
+    size_t minFree = (wifiFree < serialFree) ? wifiFree : serialFree;
 
-        // Minimum 1% if there was any traffic
-        if (busLoad[0].busloadPercentage == 0 && busLoad[0].bitsSoFar > 0)
-            busLoad[0].busloadPercentage = 1;
+    // Every BUSLOAD_INTERVAL ms, calculate the bus load of all buses and reset the counters
+    if ((millis() - busLoadTimer) >= BUSLOAD_INTERVAL)
+        updateBusLoad();
 
-        busLoad[0].bitsPerQuarter = settings.canSettings[0].nomSpeed / 4;
-        busLoad[0].bitsSoFar = 0;
+    // Frames of a PROTO_BULK_TX sequence that are due
+    serviceSchedule();
+
+    // Error events of the built in controller go out ahead of its frames. They are rare, so
+    // a plain free space check per event is enough.
+    ESP32_ERROR_EVENT event;
+    while (minFree >= MAX_ENCODED_FRAME_SIZE && CAN0.getErrorEvent(event))
+    {
+        displayErrorEvent(event, 0);
+        wifiFree = wifiGVRET.numFreeBytes();
+        serialFree = serialGVRET.numFreeBytes();
+        minFree = (wifiFree < serialFree) ? wifiFree : serialFree;
+    }
+
+    // Frames other tasks asked to have output, same free space rule as received frames
+    FORWARD_REQUEST request;
+    while (minFree >= MAX_ENCODED_FRAME_SIZE && forwardQueue && xQueueReceive(forwardQueue, &request, 0) == pdTRUE)
+    {
+        displayFrame(request.frame, request.bus);
+        wifiFree = wifiGVRET.numFreeBytes();
+        serialFree = serialGVRET.numFreeBytes();
+        minFree = (wifiFree < serialFree) ? wifiFree : serialFree;
     }
 
     // Read from each enabled CAN bus
@@ -219,36 +782,45 @@ void CANManager::loop()
         if (!settings.canSettings[i].enabled)
             continue;
 
-        // Read frames while buffer space allows
-        while ((canBuses[i]->available() > 0) && (maxLength < (WIFI_BUFF_SIZE - 80)))
+        int waiting = canBuses[i]->available();
+        if (waiting > maxQueueDepth)
+            maxQueueDepth = waiting;
+
+        // Read frames only while a worst case frame still fits. Anything else stays
+        // queued in the driver until the ring has been drained instead of being dropped.
+        while (minFree >= MAX_ENCODED_FRAME_SIZE)
         {
+            // frames cannot be put back, so never pull more than are sure to fit
+            size_t room = minFree / MAX_ENCODED_FRAME_SIZE;
+            size_t max = (room < CAN_READ_BATCH) ? room : CAN_READ_BATCH;
+            size_t count;
+
             if (settings.canSettings[i].fdMode == 0)
             {
-                // Handle classic CAN
-                canBuses[i]->read(incoming);
-                addBits(i, incoming);
-                displayFrame(incoming, i);
-
-                // Forward certain frames to ELM327 emulator
-                if ((incoming.id > 0x7DF && incoming.id < 0x7F0) || elmEmulator.getMonitorMode())
-                {
-                    elmEmulator.processCANReply(incoming);
-                }
+                count = canBuses[i]->readBatch(rxBatch, max);
+                for (size_t n = 0; n < count; n++)
+                    processFrame(rxBatch[n], i);
             }
             else
             {
-                // Handle CAN FD
-                canBuses[i]->readFD(inFD);
-                addBits(i, inFD);
-                displayFrame(inFD, i);
+                count = canBuses[i]->readBatchFD(rxBatchFD, max);
+                for (size_t n = 0; n < count; n++)
+                    processFrame(rxBatchFD[n], i);
             }
+            if (count == 0)
+                break;
+            frames += count;
 
-            toggleRXLED(); // blink RX LED on any received frame
-
-            // Update buffer usage to avoid overflow
-            wifiLength = wifiGVRET.numAvailableBytes();
-            serialLength = serialGVRET.numAvailableBytes();
-            maxLength = (wifiLength > serialLength) ? wifiLength : serialLength;
+            // Update free space to avoid overflow
+            wifiFree = wifiGVRET.numFreeBytes();
+            serialFree = serialGVRET.numFreeBytes();
+            minFree = (wifiFree < serialFree) ? wifiFree : serialFree;
         }
     }
+
+    // Driver queues are drained (or the rings are full): close any partly filled batch
+    // packets so frames are not held back waiting for more traffic
+    wifiGVRET.flushBatch();
+    serialGVRET.flushBatch();
+    return frames;
 }
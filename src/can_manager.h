@@ -1,15 +1,47 @@
 #pragma once
+#include <atomic>
 #include "config.h"
+#include "id_table.h"
+#include "id_stats.h"
 
+// Bus load in tenths of a percent
 typedef struct {
-    uint32_t bitsPerQuarter;
-    uint32_t bitsSoFar;
-    uint8_t busloadPercentage;
+    uint32_t arbitrationBits; // bits at the nominal rate since the last update
+    uint32_t dataBits;        // CAN-FD data phase bits since the last update
+    uint16_t instantLoad;     // over the last update interval
+    uint16_t averageLoad;     // exponentially weighted moving average
+    uint16_t peakLoad;        // highest instantLoad since the last reset
 } BUSLOAD;
 
-class CAN_COMMON;
-class CAN_FRAME;
-class CAN_FRAME_FD;
+#define BUSLOAD_INTERVAL 250 // ms between load updates
+#define CAN_READ_BATCH 16    // frames pulled from a driver per readBatch call
+
+#define TX_SCHEDULE_SIZE 128 // frames a PROTO_BULK_TX sequence can have waiting on the device (power of two)
+#define TX_SCHEDULE_BURST 16 // most scheduled frames sent per drain pass
+
+#define FORWARD_QUEUE_SIZE 16 // frames other tasks can have waiting for the drain task to output them
+
+// A frame another task wants in the output stream. Only the drain task encodes frames.
+typedef struct {
+    CAN_FRAME frame;
+    uint8_t bus;
+} FORWARD_REQUEST;
+
+// Last payload forwarded per ID slot, for forwarding on change only
+typedef struct {
+    uint8_t lastPayload[ID_TABLE_SLOTS][8]; // payload, or a 64 bit hash of longer FD payloads
+    uint8_t lastLength[ID_TABLE_SLOTS];     // 0xFF = nothing forwarded yet
+    uint32_t lastForwardTime[ID_TABLE_SLOTS];
+} CHANGE_STATE;
+
+// One frame of a PROTO_BULK_TX sequence waiting for its send time
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t delay; // us after the previous frame of the sequence
+    uint8_t bus;
+} TX_SCHEDULED;
+
+class GVRET_Comm_Handler;
 
 class CANManager
 {
@@ -17,14 +49,88 @@ public:
     CANManager();
     void addBits(int offset, CAN_FRAME &frame);
     void addBits(int offset, CAN_FRAME_FD &frame);    
-    void sendFrame(CAN_COMMON *bus, CAN_FRAME &frame);
-    void sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame);
+    bool sendFrame(int whichBus, CAN_FRAME &frame);
+    bool sendFrame(int whichBus, CAN_FRAME_FD &frame);
+    bool scheduleFrame(int whichBus, CAN_FRAME &frame, uint32_t delayUs, const GVRET_Comm_Handler *link);
+    int getScheduleFree(const GVRET_Comm_Handler *link);
+    bool takeScheduleReport(const GVRET_Comm_Handler *link, uint32_t &sent, uint32_t &failed);
     void displayFrame(CAN_FRAME &frame, int whichBus);
     void displayFrame(CAN_FRAME_FD &frame, int whichBus);
-    void loop();
+    void displayErrorEvent(ESP32_ERROR_EVENT &event, int whichBus);
+    int loop();
     void setup();
+    void startTask();
+    void lockBuses();
+    void unlockBuses();
+    uint32_t getMaxServiceGap();
+    int getMaxQueueDepth();
+    void resetDrainStats();
+    void setForwardMode(bool onChangeOnly, uint16_t heartbeatMs);
+    uint16_t getBusLoad(int whichBus);
+    uint16_t getBusLoadInstant(int whichBus);
+    uint16_t getBusLoadPeak(int whichBus);
+    void resetBusLoadPeak();
+    void setRateLimit(uint8_t index, RATE_LIMIT &rule);
+    void clearRateLimits();
+    int getIDCount();
+    bool getIDStat(int slot, ID_STAT &stat);
+    void clearIDStats();
 
 private:
     BUSLOAD busLoad[NUM_BUSES];
     uint32_t busLoadTimer;
+    portMUX_TYPE busLoadLock = portMUX_INITIALIZER_UNLOCKED; // frames are sent from the comm task too
+
+    // drain task
+    TaskHandle_t drainTask;
+    SemaphoreHandle_t busMutex; // held while draining, taken by anything reconfiguring a bus
+    std::atomic<int> busWaiters; // tasks blocked in lockBuses(), the drain task lets them in first
+    uint32_t lastDrainPass;     // micros() of the previous drain pass
+    uint32_t maxServiceGap;     // longest time between two drain passes (us)
+    int maxQueueDepth;          // most frames found waiting in a driver queue at once
+
+    QueueHandle_t forwardQueue; // FORWARD_REQUEST from displayFrame calls outside the drain task
+
+    CAN_FRAME rxBatch[CAN_READ_BATCH];
+    CAN_FRAME_FD rxBatchFD[CAN_READ_BATCH];
+
+    // PROTO_BULK_TX schedule, filled by the comm task and sent by the drain task. It belongs
+    // to the link that started the sequence until that link has taken the report.
+    TX_SCHEDULED txSchedule[TX_SCHEDULE_SIZE];
+    uint32_t txHead;   // next free entry (free running, masked on use)
+    uint32_t txTail;   // next frame to send
+    uint32_t txDue;    // micros() when the frame at txTail is due
+    const GVRET_Comm_Handler *txOwner; // link the running sequence came from, NULL = none
+    uint32_t txHanded; // frames of the sequence the built in bus accepted, counted once it is done
+    uint32_t txSent;   // frames other buses accepted (they can't tell when a frame went out)
+    uint32_t txFailed; // frames the drivers refused
+    uint32_t txBaseSent; // built in bus txSent when the sequence started
+    bool txReportDue;  // the schedule ran empty and the counts were not taken yet
+    portMUX_TYPE txScheduleLock = portMUX_INITIALIZER_UNLOCKED;
+
+    static void task_Drain(void *pvParameters);
+    void serviceSchedule();
+    void processFrame(CAN_FRAME &frame, int whichBus);
+    void processFrame(CAN_FRAME_FD &frame, int whichBus);
+    void updateBusLoad();
+
+    IDTable idTable;
+    IDStats idStats;
+    portMUX_TYPE idStatsLock = portMUX_INITIALIZER_UNLOCKED; // entries are read by the comm task
+
+    // "on change" forwarding: last forwarded payload per ID slot, allocated only while enabled
+    CHANGE_STATE *changeState;
+    uint16_t heartbeatInterval; // ms, 0 = only forward on change
+
+    // per ID token buckets for settings.rateLimits
+    uint8_t slotRule[ID_TABLE_SLOTS];    // index into settings.rateLimits, RULE_NONE or RULE_UNKNOWN
+    uint32_t slotTokens[ID_TABLE_SLOTS]; // in 1/1000 frame
+    uint32_t slotRefill[ID_TABLE_SLOTS]; // millis() of the last refill
+
+    bool shouldForward(int slot, uint8_t length, const uint8_t *data);
+    void makeFingerprint(uint8_t length, const uint8_t *data, uint8_t *fingerprint);
+    int findRateLimit(int slot);
+    bool takeToken(int slot);
+    void saveRateLimits();
+    void resetIDs();
 };
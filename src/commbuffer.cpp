@@ -1,49 +1,174 @@
 #include "commbuffer.h"
 #include "Logger.h"
+#include "ascii_frame.h"
 #include "gvret_comm.h"
 
+static_assert((WIFI_BUFF_SIZE & (WIFI_BUFF_SIZE - 1)) == 0, "WIFI_BUFF_SIZE must be a power of two");
+static_assert((COMM_REPLY_BUFF_SIZE & (COMM_REPLY_BUFF_SIZE - 1)) == 0, "COMM_REPLY_BUFF_SIZE must be a power of two");
+
+TaskHandle_t CommBuffer::frameProducer = NULL;
+
+static void _initRing(COMM_RING &ring, uint8_t *bytes, uint32_t size)
+{
+    ring.bytes = bytes;
+    ring.size = size;
+    ring.writeIndex = 0; // start empty
+    ring.readIndex = 0;
+    ring.highWater = 0;
+}
+
+static inline size_t _ringUsed(COMM_RING &ring)
+{
+    return ring.writeIndex.load(std::memory_order_acquire) - ring.readIndex.load(std::memory_order_acquire);
+}
+
 CommBuffer::CommBuffer()
 {
-    transmitBufferLength = 0; // start with an empty TX buffer
+    _initRing(frameRing, transmitBuffer, WIFI_BUFF_SIZE);
+    _initRing(replyRing, replyBuffer, COMM_REPLY_BUFF_SIZE);
+    consumerRing = &frameRing;
+    consumerEnd = 0;
+    droppedFrames = 0;
+    droppedBytes = 0;
+    pendingBatchSize = -1;
+    pendingDeltaMode = -1;
+    batchLength = 0;
+    batchCount = 0;
+    batchSize = 0;
+    batchLastStamp = 0;
+    deltaEncoder = nullptr;
+    deltaResetPending = false;
+}
+
+// The task that encodes frames (the CAN drain task) writes the frame ring of every buffer,
+// all other output goes through the reply ring. Until it is set there is only the setup
+// task, which uses the frame ring.
+void CommBuffer::setFrameProducer(TaskHandle_t task)
+{
+    frameProducer = task;
+}
+
+// Ring the calling task produces into
+COMM_RING &CommBuffer::producerRing()
+{
+    if (!frameProducer || xTaskGetCurrentTaskHandle() == frameProducer)
+        return frameRing;
+    return replyRing;
 }
 
 // Return how many bytes are currently buffered and ready to send
 size_t CommBuffer::numAvailableBytes()
 {
-    return transmitBufferLength;
+    return _ringUsed(frameRing) + _ringUsed(replyRing);
 }
 
-// Reset/empty the buffer (does not zero memory; just resets the length)
-void CommBuffer::clearBufferedBytes()
+// Return how many bytes the calling producer can still queue before its ring is full.
+// Space needed by the open batch packet is already counted as used so that it always
+// fits when closed.
+size_t CommBuffer::numFreeBytes()
 {
-    transmitBufferLength = 0;
+    COMM_RING &ring = producerRing();
+    size_t used = _ringUsed(ring);
+    if (&ring == &frameRing)
+        used += batchLength;
+    return (used < ring.size) ? (ring.size - used) : 0;
 }
 
-// Direct pointer to the internal buffer (read-only usage expected by callers)
-uint8_t *CommBuffer::getBufferedBytes()
+// Consumer side: pointer to the oldest buffered bytes, replies ahead of frames. length is
+// set to the number of bytes that are contiguous in memory (the rest, if any, follows
+// after wrapping or in the other ring). A ring is only left where the producer's write
+// index was when it was picked, so records of the two rings never interleave.
+uint8_t *CommBuffer::getBufferedBytes(size_t &length)
 {
-    return transmitBuffer;
+    uint32_t rd = consumerRing->readIndex.load(std::memory_order_relaxed);
+    if (rd == consumerEnd)
+    {
+        consumerRing = _ringUsed(replyRing) ? &replyRing : &frameRing;
+        rd = consumerRing->readIndex.load(std::memory_order_relaxed);
+        consumerEnd = consumerRing->writeIndex.load(std::memory_order_acquire);
+    }
+    COMM_RING &ring = *consumerRing;
+    uint32_t avail = consumerEnd - rd;
+    uint32_t offset = rd & (ring.size - 1);
+    uint32_t toEnd = ring.size - offset;
+    length = (avail < toEnd) ? avail : toEnd;
+    return &ring.bytes[offset];
 }
 
-// Copy a block of bytes into the buffer, but never overflow it
-void CommBuffer::sendBytesToBuffer(uint8_t *bytes, size_t length)
+// Consumer side: release bytes previously returned by getBufferedBytes
+void CommBuffer::consumeBufferedBytes(size_t length)
 {
-    size_t room = WIFI_BUFF_SIZE - transmitBufferLength;
-    size_t toCopy = (length <= room) ? length : room;
-    if (toCopy > 0)
+    COMM_RING &ring = *consumerRing;
+    ring.readIndex.store(ring.readIndex.load(std::memory_order_relaxed) + length, std::memory_order_release);
+}
+
+// Consumer side: throw away everything that is buffered right now
+void CommBuffer::clearBufferedBytes()
+{
+    replyRing.readIndex.store(replyRing.writeIndex.load(std::memory_order_acquire), std::memory_order_release);
+    frameRing.readIndex.store(frameRing.writeIndex.load(std::memory_order_acquire), std::memory_order_release);
+    consumerEnd = consumerRing->readIndex.load(std::memory_order_relaxed);
+}
+
+// Consumer side: write the bytes buffered on entry to a stream and release them. That is
+// at most two passes per ring (up to the end of the ring, then the wrapped part); anything
+// the producers queue meanwhile waits for the next call.
+size_t CommBuffer::drainTo(Print &out)
+{
+    size_t total = 0;
+    size_t pending = numAvailableBytes();
+    size_t length;
+    uint8_t *bytes;
+    while (total < pending)
     {
-        memcpy(&transmitBuffer[transmitBufferLength], bytes, toCopy);
-        transmitBufferLength += toCopy;
+        bytes = getBufferedBytes(length);
+        if (length == 0)
+            break;
+        if (length > pending - total)
+            length = pending - total;
+        out.write(bytes, length);
+        consumeBufferedBytes(length);
+        total += length;
     }
+    return total;
+}
+
+// Producer side: queue a block all-or-nothing so a record is never split or truncated
+bool CommBuffer::pushBytes(COMM_RING &ring, const uint8_t *bytes, size_t length)
+{
+    uint32_t wr = ring.writeIndex.load(std::memory_order_relaxed);
+    size_t used = wr - ring.readIndex.load(std::memory_order_acquire);
+    if (length > ring.size - used)
+        return false;
+
+    uint32_t offset = wr & (ring.size - 1);
+    size_t first = ring.size - offset;
+    if (first > length)
+        first = length;
+    memcpy(&ring.bytes[offset], bytes, first);
+    if (length > first)
+        memcpy(&ring.bytes[0], bytes + first, length - first);
+    ring.writeIndex.store(wr + length, std::memory_order_release);
+
+    used += length;
+    if (used > ring.highWater)
+        ring.highWater = used;
+    return true;
+}
+
+// Copy a block of bytes into the calling task's ring if it fits as a whole
+bool CommBuffer::sendBytesToBuffer(const uint8_t *bytes, size_t length)
+{
+    bool queued = pushBytes(producerRing(), bytes, length);
+    if (!queued)
+        droppedBytes.fetch_add(length, std::memory_order_relaxed);
+    return queued;
 }
 
 // Queue a single byte if there is still room left
-void CommBuffer::sendByteToBuffer(uint8_t byt)
+bool CommBuffer::sendByteToBuffer(uint8_t byt)
 {
-    if (transmitBufferLength < WIFI_BUFF_SIZE)
-    {
-        transmitBuffer[transmitBufferLength++] = byt;
-    }
+    return sendBytesToBuffer(&byt, 1);
 }
 
 // Convenience: queue an Arduino String by converting to C-string first
@@ -54,31 +179,104 @@ void CommBuffer::sendString(String str)
     sendCharString(buff);
 }
 
-// Queue a null-terminated C-string, truncated if buffer is near full
+// Queue a null-terminated C-string (dropped as a whole if the ring is full)
 void CommBuffer::sendCharString(char *str)
 {
-    char *p = str;
-    int i = 0;
-    while (*p && transmitBufferLength < WIFI_BUFF_SIZE)
+    size_t len = strlen(str);
+    if (sendBytesToBuffer((const uint8_t *)str, len))
+        Logger::debug("Queued %i bytes", len);
+}
+
+// Number of frames that could not be queued because the ring was full
+uint32_t CommBuffer::getDroppedFrames()
+{
+    return droppedFrames;
+}
+
+// Number of non-frame bytes (command replies, strings) that could not be queued
+uint32_t CommBuffer::getDroppedBytes()
+{
+    return droppedBytes;
+}
+
+// Highest frame ring fill level seen since the last reset
+size_t CommBuffer::getHighWater()
+{
+    return frameRing.highWater;
+}
+
+void CommBuffer::resetCounters()
+{
+    droppedFrames = 0;
+    droppedBytes = 0;
+    frameRing.highWater = 0;
+    replyRing.highWater = 0;
+}
+
+// Pack up to this many classic frames into one PROTO_BATCH_FRAMES packet (binary mode only).
+// 0 or 1 restores the legacy one packet per frame format. Takes effect with the next
+// frame or batch flush of the frame producer.
+void CommBuffer::setBatchSize(uint8_t frames)
+{
+    if (frames > COMM_MAX_BATCH_FRAMES)
+        frames = COMM_MAX_BATCH_FRAMES;
+    pendingBatchSize = (frames > 1) ? frames : 0;
+}
+
+uint8_t CommBuffer::getBatchSize()
+{
+    int pending = pendingBatchSize;
+    return (pending >= 0) ? (uint8_t)pending : batchSize;
+}
+
+// Send unchanged-length payloads as deltas against the last payload of the same ID
+// (binary mode only). keyframeInterval = frames per ID between full payloads, 0 = off.
+// Takes effect with the next frame or batch flush of the frame producer.
+void CommBuffer::setDeltaMode(uint8_t keyframeInterval)
+{
+    pendingDeltaMode = keyframeInterval;
+}
+
+// Frame producer side: apply mode changes posted by setBatchSize / setDeltaMode. The open
+// batch is closed first so it never mixes two modes.
+void CommBuffer::applyPendingModes()
+{
+    if (pendingBatchSize.load(std::memory_order_relaxed) < 0 && pendingDeltaMode.load(std::memory_order_relaxed) < 0)
+        return; // the usual case, checked once per frame
+    int batch = pendingBatchSize.exchange(-1);
+    int delta = pendingDeltaMode.exchange(-1);
+    if (batch < 0 && delta < 0)
+        return;
+    closeBatch();
+    if (batch >= 0)
+        batchSize = (uint8_t)batch;
+    if (delta >= 0)
     {
-        transmitBuffer[transmitBufferLength++] = *p++;
-        i++;
+        delete deltaEncoder;
+        deltaEncoder = delta ? new PayloadDeltaEncoder((uint8_t)delta) : nullptr;
+        deltaResetPending = (deltaEncoder != nullptr);
     }
-    Logger::debug("Queued %i bytes", i);
 }
 
-// --------- small helpers to make appends safer/clearer -----------
-
-// Remaining space in the TX buffer
-static inline size_t _roomLeft(size_t used)
+// A frame never reached the ring. The client now lacks a payload the delta table assumes
+// it has, so fall back to keyframes for every ID and have the client forget them too.
+void CommBuffer::frameDropped(uint32_t count)
 {
-    return (used < WIFI_BUFF_SIZE) ? (WIFI_BUFF_SIZE - used) : 0;
+    droppedFrames += count;
+    if (deltaEncoder)
+    {
+        deltaEncoder->clear();
+        deltaResetPending = true;
+    }
 }
 
+// --------- small helpers to make appends safer/clearer -----------
+// Frames are encoded into a local packet first and then pushed into the ring in one go.
+
 // Append one byte if there is room
 static inline bool _appendByte(uint8_t *buf, int &len, uint8_t b)
 {
-    if ((size_t)len >= WIFI_BUFF_SIZE)
+    if ((size_t)len >= MAX_ENCODED_FRAME_SIZE)
         return false;
     buf[len++] = b;
     return true;
@@ -92,182 +290,275 @@ static inline bool _appendU32LE(uint8_t *buf, int &len, uint32_t v)
            _appendByte(buf, len, (uint8_t)((v >> 16) & 0xFF)) &&
            _appendByte(buf, len, (uint8_t)((v >> 24) & 0xFF));
 }
+
+// Append an unsigned LEB128 varint (7 bits per byte, low bits first). Max 5 bytes.
+static inline int _appendVarint(uint8_t *buf, uint32_t v)
+{
+    int len = 0;
+    while (v > 0x7F)
+    {
+        buf[len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[len++] = (uint8_t)v;
+    return len;
+}
 // -----------------------------------------------------------------
 
-// Queue a classic CAN frame in either binary or ASCII format
-void CommBuffer::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
+// names for ESP32_EVENT_* in ASCII mode, index = event type
+static const char *eventNames[] = {"UNKNOWN", "BUS_ERROR", "ERROR_PASSIVE", "BUS_OFF",
+                                   "RECOVERED", "RX_OVERRUN", "ERROR_ACTIVE", "ARB_LOST"};
+
+/*
+Multi-frame binary packet, only sent once a client asked for it with PROTO_BATCH_FRAMES:
+  0xF1, PROTO_BATCH_FRAMES, base time(4), count(1), count * record, checksum(1)
+Each record is
+  zigzag varint time delta to the previous record (first record: to base time)
+  varint (id << 1 | extended)
+  len | bus << 4 (same as the single frame packet), bit 7 set = payload is a delta
+  data(len), or bitmap + changed bytes for deltas (see payload_delta.h)
+
+Single frame delta packet, used in delta mode when batching is off:
+  0xF1, PROTO_SET_DELTA_MODE, time(4), id(4), len | bus << 4 | 0x80, bitmap, changed bytes, checksum(1)
+
+Delta reset packet, the same with id 0 and len | bus 0, see payload_delta.h
+*/
+#define BATCH_HEADER_SIZE 7
+#define BATCH_MAX_RECORD_SIZE (5 + 5 + 1 + 1 + 8)
+
+// Queue the delta reset packet if the encoder was emptied since the last frame. Never
+// called with an open batch: everything that empties the encoder closes it first. Returns
+// false if the ring is full; the caller then drops its frame, so the reset stays pending.
+bool CommBuffer::sendDeltaReset(uint32_t stamp)
 {
-    uint8_t temp;
-    size_t writtenBytes; // kept for parity with original structure
+    uint8_t packet[12];
+    int len = 0;
+
+    if (!deltaResetPending)
+        return true;
+    _appendByte(packet, len, 0xF1);
+    _appendByte(packet, len, PROTO_SET_DELTA_MODE);
+    _appendU32LE(packet, len, stamp);
+    _appendU32LE(packet, len, 0);
+    _appendByte(packet, len, 0); // bit 7 clear: not a delta frame
+    _appendByte(packet, len, 0); // checksum placeholder
+    if (!pushBytes(frameRing, packet, len))
+        return false;
+    deltaResetPending = false;
+    return true;
+}
 
-    if (settings.useBinarySerialComm)
+// Frame producer side: close the open batch packet and queue it
+void CommBuffer::flushBatch()
+{
+    applyPendingModes();
+    closeBatch();
+}
+
+void CommBuffer::closeBatch()
+{
+    if (batchCount == 0)
+        return;
+    batchBuffer[6] = batchCount;
+    batchBuffer[batchLength++] = 0; // checksum placeholder (kept for compatibility)
+    if (!pushBytes(frameRing, batchBuffer, batchLength))
+        frameDropped(batchCount);
+    batchLength = 0;
+    batchCount = 0;
+}
+
+void CommBuffer::addFrameToBatch(CAN_FRAME &frame, int whichBus, uint32_t stamp)
+{
+    if (batchCount == 0)
     {
-        // Binary packet: 0xF1,cmd,time(4),id(4),len|bus(1),data(N),checksum(1)
-        // Total needed = 12 + payload
-        size_t need = 12 + frame.length;
-        size_t room = _roomLeft(transmitBufferLength);
-        if (room < need)
+        if (!sendDeltaReset(stamp))
         {
-            // Not enough buffer space: drop this frame silently
+            frameDropped(1);
             return;
         }
+        batchLength = 0;
+        _appendByte(batchBuffer, batchLength, 0xF1);
+        _appendByte(batchBuffer, batchLength, PROTO_BATCH_FRAMES);
+        _appendU32LE(batchBuffer, batchLength, stamp);
+        batchLength++; // count, filled in by flushBatch()
+        batchLastStamp = stamp;
+    }
 
-        // Mark extended ID by setting top bit of the ID field
-        if (frame.extended)
-            frame.id |= 1u << 31;
-
-        // Build binary packet
-        int w = (int)transmitBufferLength;
-        _appendByte(transmitBuffer, w, 0xF1);
-        _appendByte(transmitBuffer, w, 0x00); // command: classic CAN frame
-        uint32_t now = micros();
-        _appendU32LE(transmitBuffer, w, now);
-        _appendU32LE(transmitBuffer, w, frame.id);
-        _appendByte(transmitBuffer, w, (uint8_t)(frame.length + (uint8_t)(whichBus << 4)));
-        for (int c = 0; c < frame.length; c++)
-            _appendByte(transmitBuffer, w, frame.data.uint8[c]);
-        temp = 0; // checksum placeholder (kept for compatibility)
-        _appendByte(transmitBuffer, w, temp);
-
-        // Commit write
-        transmitBufferLength = (size_t)w;
+    // signed delta so frames stamped slightly out of order still encode
+    int32_t delta = (int32_t)(stamp - batchLastStamp);
+    batchLastStamp = stamp;
+    batchLength += _appendVarint(&batchBuffer[batchLength], ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    batchLength += _appendVarint(&batchBuffer[batchLength], (frame.id << 1) | (frame.extended ? 1 : 0));
+    uint8_t length = (frame.length > 8) ? 8 : frame.length;
+    int lenBus = batchLength++;
+    batchBuffer[lenBus] = (uint8_t)(length + (uint8_t)(whichBus << 4));
+    int deltaLen = 0;
+    if (deltaEncoder)
+        deltaLen = deltaEncoder->encode(frame.id, frame.extended, whichBus, length, frame.data.uint8, &batchBuffer[batchLength]);
+    if (deltaLen)
+    {
+        batchBuffer[lenBus] |= 0x80;
+        batchLength += deltaLen;
     }
     else
     {
-        // ASCII packet: "<time> - <id> <X|S> <bus> <len> <data...>\r\n"
-        // Build piecewise with snprintf and guard remaining space each step
-        size_t room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
+        memcpy(&batchBuffer[batchLength], frame.data.uint8, length);
+        batchLength += length;
+    }
+    batchCount++;
 
-        int n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, "%d - %x", micros(), frame.id);
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+    // close early if full or if another record might not fit (keep room for the checksum)
+    if (batchCount >= batchSize || batchLength + BATCH_MAX_RECORD_SIZE + 1 > COMM_BATCH_BUFF_SIZE)
+        closeBatch();
+}
 
-        room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-        n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, (frame.extended ? " X " : " S "));
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+// Frame producer side: queue a classic CAN frame in either binary or ASCII format
+void CommBuffer::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
+{
+    uint8_t packet[MAX_ENCODED_FRAME_SIZE];
+    int len = 0;
+    uint8_t temp;
 
-        room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-        n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, "%i %i", whichBus, frame.length);
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+    applyPendingModes();
+    if (settings.useBinarySerialComm && batchSize)
+    {
+        addFrameToBatch(frame, whichBus, frame.timestamp);
+        return;
+    }
 
-        // Append each data byte as hex
-        for (int c = 0; c < frame.length; c++)
+    if (settings.useBinarySerialComm)
+    {
+        // Binary packet: 0xF1,cmd,time(4),id(4),len|bus(1),data(N),checksum(1)
+        // Mark extended ID by setting top bit of the ID field
+        uint32_t id = frame.id;
+        if (frame.extended)
+            id |= 1u << 31;
+
+        uint8_t delta[9];
+        int deltaLen = 0;
+        if (deltaEncoder && !sendDeltaReset(frame.timestamp))
         {
-            room = _roomLeft(transmitBufferLength);
-            if (room == 0)
-                return;
-            n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, " %x", frame.data.uint8[c]);
-            if (n <= 0 || (size_t)n >= room)
-                return;
-            transmitBufferLength += (size_t)n;
+            frameDropped(1);
+            return;
         }
+        if (deltaEncoder)
+            deltaLen = deltaEncoder->encode(frame.id, frame.extended, whichBus, frame.length, frame.data.uint8, delta);
 
-        // Line ending
-        room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-        n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, "\r\n");
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+        // Build binary packet
+        _appendByte(packet, len, 0xF1);
+        _appendByte(packet, len, deltaLen ? PROTO_SET_DELTA_MODE : 0x00); // command: classic CAN frame
+        _appendU32LE(packet, len, frame.timestamp);
+        _appendU32LE(packet, len, id);
+        if (deltaLen)
+        {
+            _appendByte(packet, len, (uint8_t)(frame.length + (uint8_t)(whichBus << 4) + 0x80));
+            for (int c = 0; c < deltaLen; c++)
+                _appendByte(packet, len, delta[c]);
+        }
+        else
+        {
+            _appendByte(packet, len, (uint8_t)(frame.length + (uint8_t)(whichBus << 4)));
+            for (int c = 0; c < frame.length; c++)
+                _appendByte(packet, len, frame.data.uint8[c]);
+        }
+        temp = 0; // checksum placeholder (kept for compatibility)
+        _appendByte(packet, len, temp);
+    }
+    else
+    {
+        // ASCII packet: "<time> - <id> <X|S> <bus> <len> <data...>\r\n"
+        len = AsciiFrame::encode(packet, frame.timestamp, frame.id, frame.extended, whichBus,
+                                frame.length, frame.data.uint8);
     }
+
+    // Commit the whole frame or count it as dropped, never a partial record
+    if (!pushBytes(frameRing, packet, len))
+        frameDropped(1);
 }
 
-// Queue a CAN FD frame in either binary or ASCII format
+// Frame producer side: queue a CAN FD frame in either binary or ASCII format
 void CommBuffer::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus)
 {
+    uint8_t packet[MAX_ENCODED_FRAME_SIZE];
+    int len = 0;
     uint8_t temp;
-    size_t writtenBytes; // kept for parity with original structure
+
+    // FD frames always use their own packet; close any open batch first to keep order
+    applyPendingModes();
+    closeBatch();
 
     if (settings.useBinarySerialComm)
     {
         // Binary FD packet: 0xF1,cmd,time(4),id(4),len(1),bus(1),data(N),checksum(1)
-        // Total needed = 13 + payload
-        size_t need = 13 + frame.length;
-        size_t room = _roomLeft(transmitBufferLength);
-        if (room < need)
-        {
-            // Not enough buffer space: drop this frame silently
-            return;
-        }
-
+        uint32_t id = frame.id;
         if (frame.extended)
-            frame.id |= 1u << 31;
-
-        int w = (int)transmitBufferLength;
-        _appendByte(transmitBuffer, w, 0xF1);
-        _appendByte(transmitBuffer, w, PROTO_BUILD_FD_FRAME);
-        uint32_t now = micros();
-        _appendU32LE(transmitBuffer, w, now);
-        _appendU32LE(transmitBuffer, w, frame.id);
-        _appendByte(transmitBuffer, w, frame.length);
-        _appendByte(transmitBuffer, w, (uint8_t)whichBus);
+            id |= 1u << 31;
+
+        _appendByte(packet, len, 0xF1);
+        _appendByte(packet, len, PROTO_BUILD_FD_FRAME);
+        _appendU32LE(packet, len, frame.timestamp);
+        _appendU32LE(packet, len, id);
+        _appendByte(packet, len, frame.length);
+        _appendByte(packet, len, (uint8_t)whichBus);
         for (int c = 0; c < frame.length; c++)
-            _appendByte(transmitBuffer, w, frame.data.uint8[c]);
+            _appendByte(packet, len, frame.data.uint8[c]);
         temp = 0; // checksum placeholder (kept for compatibility)
-        _appendByte(transmitBuffer, w, temp);
-
-        // Commit write
-        transmitBufferLength = (size_t)w;
+        _appendByte(packet, len, temp);
     }
     else
     {
         // ASCII packet for FD: same style as classic, but length can be > 8
-        size_t room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-
-        int n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, "%d - %x", micros(), frame.id);
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+        len = AsciiFrame::encode(packet, frame.timestamp, frame.id, frame.extended, whichBus,
+                                frame.length, frame.data.uint8);
+    }
 
-        room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-        n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, (frame.extended ? " X " : " S "));
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+    // Commit the whole frame or count it as dropped, never a partial record
+    if (!pushBytes(frameRing, packet, len))
+        frameDropped(1);
+}
 
-        room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-        n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, "%i %i", whichBus, frame.length);
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+// Queue a bus error event from the driver. Binary: its own packet, like FD frames, so it
+// lands between the frames it happened between.
+void CommBuffer::sendErrorEventToBuffer(ESP32_ERROR_EVENT &event, int whichBus)
+{
+    uint8_t packet[MAX_ENCODED_FRAME_SIZE];
+    int len = 0;
 
-        // Append each data byte as hex
-        for (int c = 0; c < frame.length; c++)
-        {
-            room = _roomLeft(transmitBufferLength);
-            if (room == 0)
-                return;
-            n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, " %x", frame.data.uint8[c]);
-            if (n <= 0 || (size_t)n >= room)
-                return;
-            transmitBufferLength += (size_t)n;
-        }
+    applyPendingModes();
+    closeBatch();
 
-        // Line ending
-        room = _roomLeft(transmitBufferLength);
-        if (room == 0)
-            return;
-        n = snprintf((char *)&transmitBuffer[transmitBufferLength], room, "\r\n");
-        if (n <= 0 || (size_t)n >= room)
-            return;
-        transmitBufferLength += (size_t)n;
+    if (settings.useBinarySerialComm)
+    {
+        // Binary event packet: 0xF1,cmd,time(4),bus(1),event(1),tx errors(1),rx errors(1)
+        _appendByte(packet, len, 0xF1);
+        _appendByte(packet, len, PROTO_ERROR_EVENT);
+        _appendU32LE(packet, len, event.timestamp);
+        _appendByte(packet, len, (uint8_t)whichBus);
+        _appendByte(packet, len, event.type);
+        _appendByte(packet, len, event.txErrors);
+        _appendByte(packet, len, event.rxErrors);
     }
+    else
+    {
+        // ASCII: "<time> - ERROR <bus> <event> TEC <n> REC <n>"
+        const char *name = eventNames[(event.type < sizeof(eventNames) / sizeof(eventNames[0])) ? event.type : 0];
+        len = AsciiFrame::appendDec(packet, (int32_t)event.timestamp);
+        memcpy(&packet[len], " - ERROR ", 9);
+        len += 9;
+        len += AsciiFrame::appendDec(&packet[len], whichBus);
+        packet[len++] = ' ';
+        memcpy(&packet[len], name, strlen(name));
+        len += strlen(name);
+        memcpy(&packet[len], " TEC ", 5);
+        len += 5;
+        len += AsciiFrame::appendDec(&packet[len], event.txErrors);
+        memcpy(&packet[len], " REC ", 5);
+        len += 5;
+        len += AsciiFrame::appendDec(&packet[len], event.rxErrors);
+        packet[len++] = '\r';
+        packet[len++] = '\n';
+    }
+
+    if (!pushBytes(frameRing, packet, len))
+        frameDropped(1);
 }
@@ -1,23 +1,92 @@
 #pragma once
 #include <Arduino.h>
+#include <atomic>
 #include "config.h"
 #include "esp32_can.h"
+#include "payload_delta.h"
+
+// Worst case size of one encoded frame: ASCII CAN-FD frame with 64 data bytes
+#define MAX_ENCODED_FRAME_SIZE 224
+
+// Multi-frame binary packets (PROTO_BATCH_FRAMES)
+#define COMM_BATCH_BUFF_SIZE 512 // one open batch packet, must stay well below WIFI_BUFF_SIZE
+#define COMM_MAX_BATCH_FRAMES 64
+
+#define COMM_REPLY_BUFF_SIZE 1024 // command replies and console text (power of two)
+
+// Single producer / single consumer byte ring. Both indices run freely and are masked on
+// access, so the producer and the consumer can live in different FreeRTOS tasks.
+struct COMM_RING
+{
+    uint8_t *bytes;
+    uint32_t size;
+    std::atomic<uint32_t> writeIndex; // only advanced by the producer
+    std::atomic<uint32_t> readIndex;  // only advanced by the consumer
+    size_t highWater;                 // only written by the producer
+};
 
 class CommBuffer
 {
 public:
     CommBuffer();
     size_t numAvailableBytes();
-    uint8_t* getBufferedBytes();
+    size_t numFreeBytes();
+    uint8_t* getBufferedBytes(size_t &length);
+    void consumeBufferedBytes(size_t length);
     void clearBufferedBytes();
+    size_t drainTo(Print &out);
     void sendFrameToBuffer(CAN_FRAME &frame, int whichBus);
     void sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus);
-    void sendBytesToBuffer(uint8_t *bytes, size_t length);
-    void sendByteToBuffer(uint8_t byt);
+    void sendErrorEventToBuffer(ESP32_ERROR_EVENT &event, int whichBus);
+    bool sendBytesToBuffer(const uint8_t *bytes, size_t length);
+    bool sendByteToBuffer(uint8_t byt);
     void sendString(String str);
     void sendCharString(char *str);
+    void setBatchSize(uint8_t frames);
+    uint8_t getBatchSize();
+    void flushBatch();
+    void setDeltaMode(uint8_t keyframeInterval);
+    uint32_t getDroppedFrames();
+    uint32_t getDroppedBytes();
+    size_t getHighWater();
+    void resetCounters();
+    static void setFrameProducer(TaskHandle_t task);
 
 protected:
+    // Frames come from the CAN drain task, command replies and console output from the
+    // comm task. Each of the two producers writes its own ring, so neither takes a lock;
+    // the consumer empties both (replies first). Only the frame producer may encode frames
+    // and touch the batch and delta state.
     byte transmitBuffer[WIFI_BUFF_SIZE];
-    int transmitBufferLength; //not creating a ring buffer. The buffer should be large enough to never overflow
-};
\ No newline at end of file
+    byte replyBuffer[COMM_REPLY_BUFF_SIZE];
+    COMM_RING frameRing;
+    COMM_RING replyRing;
+    COMM_RING *consumerRing; // ring the chunk of the last getBufferedBytes call is in
+    uint32_t consumerEnd;    // write index of consumerRing when it was picked, a record boundary
+    static TaskHandle_t frameProducer;
+    uint32_t droppedFrames;
+    std::atomic<uint32_t> droppedBytes; // bytes can be dropped by either producer
+
+    // mode changes from the comm task, picked up by the frame producer (-1 = none pending)
+    std::atomic<int> pendingBatchSize;
+    std::atomic<int> pendingDeltaMode;
+
+    // open multi-frame packet, pushed into the ring as a whole by flushBatch()
+    uint8_t batchBuffer[COMM_BATCH_BUFF_SIZE];
+    int batchLength;
+    uint8_t batchCount;
+    uint8_t batchSize; // 0 = one legacy packet per frame
+    uint32_t batchLastStamp;
+
+    // per-ID payload deltas (PROTO_SET_DELTA_MODE), allocated only while enabled
+    PayloadDeltaEncoder *deltaEncoder;
+    bool deltaResetPending; // the encoder was emptied, tell the client before the next frame
+
+    COMM_RING &producerRing();
+    bool pushBytes(COMM_RING &ring, const uint8_t *bytes, size_t length);
+    void applyPendingModes();
+    void closeBatch();
+    void addFrameToBatch(CAN_FRAME &frame, int whichBus, uint32_t stamp);
+    void frameDropped(uint32_t count);
+    bool sendDeltaReset(uint32_t stamp);
+};
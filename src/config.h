@@ -9,6 +9,9 @@
 #define SER_BUFF_SIZE 1024            // serial write buffer
 #define WIFI_BUFF_SIZE 2048           // GVRET/ELM TCP buffer (fits within typical 2312 MTU)
 #define SER_BUFF_FLUSH_INTERVAL 20000 // us between forced flushes
+#define SER_RX_BLOCK 256              // input bytes handed to the GVRET parser in one call
+#define SER_RX_BUDGET 2000            // us per comm loop spent parsing serial input
+#define STATS_LOG_INTERVAL 10000      // ms between STATS lines on the telnet port (text mode only)
 
 // Build / prefs / names
 #define CFG_BUILD_NUM 618
@@ -31,6 +34,16 @@
 // WiFi
 #define MAX_CLIENTS 1
 
+// Tasks. The CAN drain task shares the core of the driver's low level RX task,
+// WiFi / Bluetooth / serial handling runs on the other one.
+#define CAN_DRAIN_CORE 1
+#define CAN_DRAIN_PRIORITY 17
+#define COMM_TASK_CORE 0
+#define COMM_TASK_PRIORITY 2
+
+// Output rate limiting
+#define MAX_RATE_LIMITS 16
+
 // Optional CAN filter struct (currently unused but kept for compatibility)
 struct FILTER
 {
@@ -40,6 +53,19 @@ struct FILTER
     boolean enabled;
 } __attribute__((__packed__));
 
+// Maximum forwarding rate for every ID in [idLow, idHigh] (set over GVRET, stored as "ratelimits")
+struct RATE_LIMIT
+{
+    uint32_t idLow;
+    uint32_t idHigh;
+    uint16_t maxRate; // frames per second per ID, 0 = do not forward at all
+    uint8_t bus;      // 0xFF = any bus
+    uint8_t flags;    // bit 0 = extended IDs, bit 7 = rule in use
+} __attribute__((__packed__));
+
+#define RATE_LIMIT_EXTENDED 0x01
+#define RATE_LIMIT_ENABLED 0x80
+
 struct CANFDSettings
 {
     uint32_t nomSpeed;
@@ -52,6 +78,7 @@ struct CANFDSettings
 struct EEPROMSettings
 {
     CANFDSettings canSettings[NUM_BUSES];
+    RATE_LIMIT rateLimits[MAX_RATE_LIMITS];
 
     boolean useBinarySerialComm; // use binary protocol for frames over serial?
 
@@ -6,15 +6,69 @@ GVRET_Comm_Handler::GVRET_Comm_Handler()
 {
     step = 0;
     state = IDLE;
+    compressedMode = false;
+    consoleLength = 0;
+    dumpSlot = -1;
+    bulkCount = 0;
+    bulkFlags = 0;
+    bulkAccepted = 0;
+    bulkPos = 0;
+    bulkPending = false;
+}
+
+// Ask the link layer to wrap the output for the current client in PROTO_SET_COMPRESSION blocks
+void GVRET_Comm_Handler::setCompressedMode(bool state)
+{
+    compressedMode = state;
+}
+
+bool GVRET_Comm_Handler::getCompressedMode()
+{
+    return compressedMode;
+}
+
+// Parse a block of bytes from the link. Complete PROTO_BUILD_CAN_FRAME packets, the bulk
+// of what injection scripts send, are decoded straight from the block. Everything else,
+// and any packet split across two blocks, goes through the byte state machine.
+void GVRET_Comm_Handler::processIncomingBytes(const uint8_t *bytes, size_t length)
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        // F1 00 id(4) bus(1) len(1) data(len) checksum(1)
+        if (state == IDLE && bytes[i] == 0xF1 && length - i >= 8 && bytes[i + 1] == PROTO_BUILD_CAN_FRAME)
+        {
+            const uint8_t *p = &bytes[i];
+            uint8_t dataLen = p[7] & 0xF;
+            if (dataLen > 8)
+                dataLen = 8;
+            if (length - i >= (size_t)dataLen + 9)
+            {
+                uint32_t id = p[2] | (p[3] << 8) | (p[4] << 16) | ((uint32_t)p[5] << 24);
+                build_out_frame.extended = (id & 0x80000000ul) ? true : false;
+                build_out_frame.id = id & 0x7FFFFFFF;
+                build_out_frame.length = dataLen;
+                build_out_frame.rtr = 0;
+                memcpy(build_out_frame.data.uint8, &p[8], dataLen);
+                out_bus = p[6] & 3;
+                canManager.sendFrame(out_bus, build_out_frame);
+                i += dataLen + 9;
+                continue;
+            }
+        }
+        processIncomingByte(bytes[i++]);
+    }
 }
 
 void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
 {
     uint32_t busSpeed = 0;
-    uint32_t now = micros(); // used for timestamp responses
+    uint32_t now;
 
     uint8_t temp8;
     uint16_t temp16;
+    uint8_t reply[20];
+    int len = 0;
 
     switch (state)
     {
@@ -26,12 +80,15 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
         }
         else if (in_byte == 0xE7)
         {
-            // Switch to binary serial comm
+            // Switch to binary serial comm. A (re)connecting client starts with
+            // single full frame packets until it negotiates batching / deltas again.
             settings.useBinarySerialComm = true;
+            setBatchSize(0);
+            setDeltaMode(0);
         }
-        else
+        else if (!settings.useBinarySerialComm)
         {
-            // Ignore unrelated data in idle state
+            processConsoleByte(in_byte);
         }
         break;
 
@@ -49,37 +106,41 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             // Send current microsecond counter
             state = TIME_SYNC;
             step = 0;
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 1;
-            transmitBuffer[transmitBufferLength++] = (uint8_t)(now & 0xFF);
-            transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 8);
-            transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 16);
-            transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 24);
+            now = micros();
+            reply[len++] = 0xF1;
+            reply[len++] = 1;
+            reply[len++] = (uint8_t)(now & 0xFF);
+            reply[len++] = (uint8_t)(now >> 8);
+            reply[len++] = (uint8_t)(now >> 16);
+            reply[len++] = (uint8_t)(now >> 24);
+            sendBytesToBuffer(reply, len);
             break;
 
         case PROTO_DIG_INPUTS:
             // Return placeholder for digital inputs
             temp8 = 0;
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 2;
-            transmitBuffer[transmitBufferLength++] = temp8;
+            reply[len++] = 0xF1;
+            reply[len++] = 2;
+            reply[len++] = temp8;
             temp8 = checksumCalc(buff, 2);
-            transmitBuffer[transmitBufferLength++] = temp8;
+            reply[len++] = temp8;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
         case PROTO_ANA_INPUTS:
             // Return placeholder for analog inputs (all zero)
             temp16 = 0;
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 3;
+            reply[len++] = 0xF1;
+            reply[len++] = 3;
             for (int k = 0; k < 7; k++)
             {
-                transmitBuffer[transmitBufferLength++] = (uint8_t)(temp16 & 0xFF);
-                transmitBuffer[transmitBufferLength++] = (uint8_t)(temp16 >> 8);
+                reply[len++] = (uint8_t)(temp16 & 0xFF);
+                reply[len++] = (uint8_t)(temp16 >> 8);
             }
             temp8 = checksumCalc(buff, 9);
-            transmitBuffer[transmitBufferLength++] = temp8;
+            reply[len++] = temp8;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
@@ -96,35 +157,37 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
 
         case PROTO_GET_CANBUS_PARAMS:
             // Send parameters for CAN0 and CAN1
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 6;
+            reply[len++] = 0xF1;
+            reply[len++] = 6;
             // Bus 0
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].enabled +
+            reply[len++] = settings.canSettings[0].enabled +
                 ((unsigned char)settings.canSettings[0].listenOnly << 4);
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 8;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 16;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 24;
+            reply[len++] = settings.canSettings[0].nomSpeed;
+            reply[len++] = settings.canSettings[0].nomSpeed >> 8;
+            reply[len++] = settings.canSettings[0].nomSpeed >> 16;
+            reply[len++] = settings.canSettings[0].nomSpeed >> 24;
             // Bus 1
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].enabled +
+            reply[len++] = settings.canSettings[1].enabled +
                 ((unsigned char)settings.canSettings[1].listenOnly << 4);
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 8;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 16;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 24;
+            reply[len++] = settings.canSettings[1].nomSpeed;
+            reply[len++] = settings.canSettings[1].nomSpeed >> 8;
+            reply[len++] = settings.canSettings[1].nomSpeed >> 16;
+            reply[len++] = settings.canSettings[1].nomSpeed >> 24;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
         case PROTO_GET_DEV_INFO:
             // Send firmware build info
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 7;
-            transmitBuffer[transmitBufferLength++] = CFG_BUILD_NUM & 0xFF;
-            transmitBuffer[transmitBufferLength++] = (CFG_BUILD_NUM >> 8);
-            transmitBuffer[transmitBufferLength++] = 0x20;
-            transmitBuffer[transmitBufferLength++] = 0;
-            transmitBuffer[transmitBufferLength++] = 0;
-            transmitBuffer[transmitBufferLength++] = 0;
+            reply[len++] = 0xF1;
+            reply[len++] = 7;
+            reply[len++] = CFG_BUILD_NUM & 0xFF;
+            reply[len++] = (CFG_BUILD_NUM >> 8);
+            reply[len++] = 0x20;
+            reply[len++] = 0;
+            reply[len++] = 0;
+            reply[len++] = 0;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
@@ -136,10 +199,11 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
 
         case PROTO_KEEPALIVE:
             // Respond with keepalive ack
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 0x09;
-            transmitBuffer[transmitBufferLength++] = 0xDE;
-            transmitBuffer[transmitBufferLength++] = 0xAD;
+            reply[len++] = 0xF1;
+            reply[len++] = 0x09;
+            reply[len++] = 0xDE;
+            reply[len++] = 0xAD;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
@@ -158,18 +222,20 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
 
         case PROTO_GET_NUMBUSES:
             // Send number of CAN buses available
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 12;
-            transmitBuffer[transmitBufferLength++] = SysSettings.numBuses;
+            reply[len++] = 0xF1;
+            reply[len++] = 12;
+            reply[len++] = SysSettings.numBuses;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
         case PROTO_GET_EXT_BUSES:
             // Extended bus info (placeholder)
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 13;
+            reply[len++] = 0xF1;
+            reply[len++] = 13;
             for (int u = 2; u < 17; u++)
-                transmitBuffer[transmitBufferLength++] = 0;
+                reply[len++] = 0;
+            sendBytesToBuffer(reply, len);
             state = IDLE;
             break;
 
@@ -179,6 +245,51 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             step = 0;
             buff[0] = 0xF1;
             break;
+
+        case PROTO_BATCH_FRAMES:
+            // Next byte: max frames per batch packet (0 = back to single frame packets)
+            state = SET_BATCH_MODE;
+            break;
+
+        case PROTO_SET_COMPRESSION:
+            // Next byte: 1 = compressed stream on the WiFi port, 0 = plain
+            state = SET_COMPRESSION;
+            break;
+
+        case PROTO_SET_DELTA_MODE:
+            // Next byte: keyframe interval in frames per ID (0 = full payloads only)
+            state = SET_DELTA_MODE;
+            break;
+
+        case PROTO_SET_FORWARD_MODE:
+            // Next bytes: mode (0 = every frame, 1 = on change), heartbeat ms (2)
+            state = SET_FORWARD_MODE;
+            step = 0;
+            break;
+
+        case PROTO_SET_RATE_LIMIT:
+            // Next bytes: rule index (0xFF = clear all), bus (0xFF = any), flags (RATE_LIMIT_*),
+            // first ID (4), last ID (4), max frames per second per ID (2)
+            state = SET_RATE_LIMIT;
+            step = 0;
+            break;
+
+        case PROTO_GET_ID_STATS:
+            // Next bytes: first ID table slot to report (2)
+            state = GET_ID_STATS;
+            step = 0;
+            break;
+
+        case PROTO_GET_DRIVER_STATS:
+            // Next byte: 1 = clear the counters after reporting them
+            state = GET_DRIVER_STATS;
+            break;
+
+        case PROTO_BULK_TX:
+            // Next bytes: count(1), flags(1), count * ([delay(4)] id(4) bus(1) len(1) data(len))
+            state = BULK_TX;
+            step = 0;
+            break;
         }
         break;
 
@@ -214,8 +325,7 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             {
                 state = IDLE;
                 build_out_frame.rtr = 0;
-                if (out_bus < NUM_BUSES)
-                    canManager.sendFrame(canBuses[out_bus], build_out_frame);
+                canManager.sendFrame(out_bus, build_out_frame);
             }
             break;
         }
@@ -259,13 +369,14 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             }
             else settings.canSettings[0].enabled = false;
 
+            canManager.lockBuses();
             if (settings.canSettings[0].enabled)
             {
-                canBuses[0]->begin(settings.canSettings[0].nomSpeed, 255);
-                canBuses[0]->setListenOnlyMode(settings.canSettings[0].listenOnly);
+                canBuses[0]->reconfigure(settings.canSettings[0].nomSpeed, settings.canSettings[0].listenOnly);
                 canBuses[0]->watchFor();
             }
             else canBuses[0]->disable();
+            canManager.unlockBuses();
             break;
 
         case 4: build_int = in_byte; break;
@@ -288,13 +399,14 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             }
             else settings.canSettings[1].enabled = false;
 
+            canManager.lockBuses();
             if (settings.canSettings[1].enabled)
             {
-                canBuses[1]->begin(settings.canSettings[1].nomSpeed, 255);
-                canBuses[1]->setListenOnlyMode(settings.canSettings[1].listenOnly);
+                canBuses[1]->reconfigure(settings.canSettings[1].nomSpeed, settings.canSettings[1].listenOnly);
                 canBuses[1]->watchFor();
             }
             else canBuses[1]->disable();
+            canManager.unlockBuses();
 
             state = IDLE;
             break;
@@ -313,6 +425,73 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
         state = IDLE;
         break;
 
+    case SET_BATCH_MODE:
+        setBatchSize(in_byte);
+        state = IDLE;
+        break;
+
+    case SET_COMPRESSION:
+        setCompressedMode(in_byte != 0);
+        state = IDLE;
+        break;
+
+    case SET_DELTA_MODE:
+        setDeltaMode(in_byte);
+        state = IDLE;
+        break;
+
+    case SET_FORWARD_MODE:
+        switch (step)
+        {
+        case 0: buff[1] = in_byte; break;
+        case 1: build_int = in_byte; break;
+        case 2:
+            build_int |= in_byte << 8;
+            canManager.setForwardMode(buff[1] != 0, (uint16_t)build_int);
+            state = IDLE;
+            break;
+        }
+        step++;
+        break;
+
+    case SET_RATE_LIMIT:
+        buff[step++] = in_byte;
+        if (step == 13)
+        {
+            if (buff[0] == 0xFF)
+                canManager.clearRateLimits();
+            else
+            {
+                RATE_LIMIT rule;
+                rule.bus = buff[1];
+                rule.flags = buff[2];
+                rule.idLow = buff[3] | (buff[4] << 8) | (buff[5] << 16) | ((uint32_t)buff[6] << 24);
+                rule.idHigh = buff[7] | (buff[8] << 8) | (buff[9] << 16) | ((uint32_t)buff[10] << 24);
+                rule.maxRate = buff[11] | (buff[12] << 8);
+                canManager.setRateLimit(buff[0], rule);
+            }
+            state = IDLE;
+        }
+        break;
+
+    case GET_ID_STATS:
+        buff[step++] = in_byte;
+        if (step == 2)
+        {
+            sendIDStats(buff[0] | (buff[1] << 8));
+            state = IDLE;
+        }
+        break;
+
+    case GET_DRIVER_STATS:
+        sendDriverStats(in_byte & 1);
+        state = IDLE;
+        break;
+
+    case BULK_TX:
+        processBulkTXByte(in_byte);
+        break;
+
     case ECHO_CAN_FRAME:
         // Echo back a CAN frame without sending to bus
         buff[1 + step] = in_byte;
@@ -343,6 +522,7 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             else
             {
                 state = IDLE;
+                build_out_frame.timestamp = micros(); // not received, so stamp it on the way out
                 canManager.displayFrame(build_out_frame, 0);
             }
             break;
@@ -372,6 +552,89 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
     }
 }
 
+/*
+PROTO_BULK_TX: hand a sequence of classic frames to the device, which sends them on its own
+timeline so playback does not depend on the host link latency.
+  F1 1F count(1) flags(1) count * record
+  record: [delay(4)] id(4, bit 31 = extended) bus(1) len(1) data(len)
+delay is only present with BULK_TX_TIMED and is the time in us after the previous frame of
+the sequence (the first frame of an idle schedule: after the packet arrived). Without it
+frames go out as fast as the bus takes them. Replies:
+  F1 1F 00 accepted(1) free(2)  right away: records scheduled, schedule slots still free
+  F1 1F 01 sent(4) failed(4)    once every frame of the sequence went out on the bus or failed
+Only the built in bus (bus 0) reports when a frame really went out. Frames for other buses
+count as sent once their driver accepted them.
+Records that do not fit are not scheduled, the host resends them after the next reply. The
+schedule belongs to the link that started a sequence until that link got its DONE reply, the
+other link finds no free slots until then.
+*/
+void GVRET_Comm_Handler::processBulkTXByte(uint8_t in_byte)
+{
+    if (step == 0)
+    {
+        bulkCount = in_byte;
+        bulkAccepted = 0;
+        step++;
+        return;
+    }
+    if (step == 1)
+    {
+        bulkFlags = in_byte;
+        bulkPos = 0;
+        step++;
+        if (bulkCount == 0)
+            finishBulkTX();
+        return;
+    }
+
+    buff[bulkPos++] = in_byte;
+    int header = (bulkFlags & BULK_TX_TIMED) ? 10 : 6;
+    if (bulkPos < header)
+        return;
+    uint8_t dataLen = buff[header - 1] & 0xF;
+    if (dataLen > 8)
+        dataLen = 8;
+    if (bulkPos < header + dataLen)
+        return;
+
+    const uint8_t *rec = buff;
+    uint32_t delay = 0;
+    if (bulkFlags & BULK_TX_TIMED)
+    {
+        delay = rec[0] | (rec[1] << 8) | (rec[2] << 16) | ((uint32_t)rec[3] << 24);
+        rec += 4;
+    }
+    uint32_t id = rec[0] | (rec[1] << 8) | (rec[2] << 16) | ((uint32_t)rec[3] << 24);
+    build_out_frame.extended = (id & 0x80000000ul) ? true : false;
+    build_out_frame.id = id & 0x7FFFFFFF;
+    build_out_frame.length = dataLen;
+    build_out_frame.rtr = 0;
+    memcpy(build_out_frame.data.uint8, &rec[6], dataLen);
+    if (canManager.scheduleFrame(rec[4], build_out_frame, delay, this))
+        bulkAccepted++;
+
+    bulkPos = 0;
+    if (--bulkCount == 0)
+        finishBulkTX();
+}
+
+// Whole PROTO_BULK_TX packet received: acknowledge it
+void GVRET_Comm_Handler::finishBulkTX()
+{
+    uint8_t reply[6];
+    int free = canManager.getScheduleFree(this);
+    reply[0] = 0xF1;
+    reply[1] = PROTO_BULK_TX;
+    reply[2] = BULK_TX_ACK;
+    reply[3] = bulkAccepted;
+    reply[4] = (uint8_t)free;
+    reply[5] = (uint8_t)(free >> 8);
+    sendBytesToBuffer(reply, 6);
+    if (bulkAccepted)
+        bulkPending = true;
+    state = IDLE;
+}
+
 // Simple XOR checksum
 uint8_t GVRET_Comm_Handler::checksumCalc(uint8_t *buffer, int length)
 {
@@ -380,3 +643,220 @@ uint8_t GVRET_Comm_Handler::checksumCalc(uint8_t *buffer, int length)
         valu ^= buffer[c];
     return valu;
 }
+
+// Reply to PROTO_GET_ID_STATS with up to ID_STATS_PER_PACKET IDs starting at slot start:
+//   F1 1C total(2) next(2) count(1) records
+// next is the slot to ask for to continue (== total when all IDs were sent). Each record:
+//   id(4, bit 31 = extended) bus(1) frames(4) mean(4) min(4) max(4) jitter(4) len(1) data(8)
+// with periods and jitter in microseconds.
+void GVRET_Comm_Handler::sendIDStats(uint16_t start)
+{
+    uint8_t reply[7 + ID_STATS_PER_PACKET * ID_STATS_RECORD_SIZE];
+    int total = canManager.getIDCount();
+    int slot = start;
+    int count = 0;
+    int len = 7;
+    ID_STAT stat;
+
+    for (; slot < total && count < ID_STATS_PER_PACKET; slot++)
+    {
+        if (!canManager.getIDStat(slot, stat))
+            continue;
+        uint32_t values[6] = {stat.id | (stat.extended ? 0x80000000u : 0), stat.count, stat.meanPeriod,
+                              stat.minPeriod, stat.maxPeriod, stat.jitter};
+        for (int v = 0; v < 6; v++)
+        {
+            reply[len++] = (uint8_t)values[v];
+            reply[len++] = (uint8_t)(values[v] >> 8);
+            reply[len++] = (uint8_t)(values[v] >> 16);
+            reply[len++] = (uint8_t)(values[v] >> 24);
+            if (v == 0)
+                reply[len++] = stat.bus;
+        }
+        reply[len++] = stat.length;
+        memcpy(&reply[len], stat.data, 8);
+        len += 8;
+        count++;
+    }
+
+    reply[0] = 0xF1;
+    reply[1] = PROTO_GET_ID_STATS;
+    reply[2] = (uint8_t)total;
+    reply[3] = (uint8_t)(total >> 8);
+    reply[4] = (uint8_t)slot;
+    reply[5] = (uint8_t)(slot >> 8);
+    reply[6] = count;
+    sendBytesToBuffer(reply, len);
+}
+
+// PROTO_GET_DRIVER_STATS reply: F1 1D followed by DRIVER_STATS_VALUES u32 (LE) in this order
+//   TWAI rx queue missed, TWAI FIFO overruns, rx queue full, callback queue full,
+//   rx queue high water, callback queue high water, drain gap max (us), drain backlog max,
+//   serial dropped frames / dropped bytes / high water, wifi dropped frames / dropped bytes / high water,
+//   tx sent, tx failed, tx queue full, tx queue high water
+void GVRET_Comm_Handler::sendDriverStats(bool reset)
+{
+    uint8_t reply[2 + DRIVER_STATS_VALUES * 4];
+    int len = 0;
+    ESP32_DRIVER_STATS driver;
+
+    CAN0.getDriverStats(driver);
+    uint32_t values[DRIVER_STATS_VALUES] = {
+        driver.twaiQueueMissed, driver.twaiFifoOverruns, driver.rxQueueFull, driver.callbackQueueFull,
+        driver.rxHighWater, driver.callbackHighWater,
+        canManager.getMaxServiceGap(), (uint32_t)canManager.getMaxQueueDepth(),
+        serialGVRET.getDroppedFrames(), serialGVRET.getDroppedBytes(), (uint32_t)serialGVRET.getHighWater(),
+        wifiGVRET.getDroppedFrames(), wifiGVRET.getDroppedBytes(), (uint32_t)wifiGVRET.getHighWater(),
+        driver.txSent, driver.txFailed, driver.txQueueFull, driver.txHighWater};
+
+    reply[len++] = 0xF1;
+    reply[len++] = PROTO_GET_DRIVER_STATS;
+    for (int v = 0; v < DRIVER_STATS_VALUES; v++)
+    {
+        reply[len++] = (uint8_t)values[v];
+        reply[len++] = (uint8_t)(values[v] >> 8);
+        reply[len++] = (uint8_t)(values[v] >> 16);
+        reply[len++] = (uint8_t)(values[v] >> 24);
+    }
+    sendBytesToBuffer(reply, len);
+
+    if (reset)
+        resetStats();
+}
+
+// Everything that says whether a capture was complete, on one text line. Used by the STATS
+// console command and by the periodic log on the telnet port.
+void GVRET_Comm_Handler::sendStatsLog()
+{
+    char line[256];
+    ESP32_DRIVER_STATS driver;
+
+    CAN0.getDriverStats(driver);
+    snprintf(line, sizeof(line), "STATS twai missed %u overrun %u, rx full %u hw %u, cb full %u hw %u, "
+                  "drain gap %u us backlog %i, serial drop %u hw %u, wifi drop %u hw %u, "
+                  "tx sent %u fail %u full %u hw %u\r\n",
+            (unsigned)driver.twaiQueueMissed, (unsigned)driver.twaiFifoOverruns,
+            (unsigned)driver.rxQueueFull, driver.rxHighWater, (unsigned)driver.callbackQueueFull, driver.callbackHighWater,
+            (unsigned)canManager.getMaxServiceGap(), canManager.getMaxQueueDepth(),
+            (unsigned)serialGVRET.getDroppedFrames(), (unsigned)serialGVRET.getHighWater(),
+            (unsigned)wifiGVRET.getDroppedFrames(), (unsigned)wifiGVRET.getHighWater(),
+            (unsigned)driver.txSent, (unsigned)driver.txFailed, (unsigned)driver.txQueueFull, driver.txHighWater);
+    sendCharString(line);
+}
+
+void GVRET_Comm_Handler::resetStats()
+{
+    CAN0.resetDriverStats();
+    canManager.resetDrainStats();
+    serialGVRET.resetCounters();
+    wifiGVRET.resetCounters();
+}
+
+void GVRET_Comm_Handler::processConsoleByte(uint8_t in_byte)
+{
+    if (in_byte == '\r' || in_byte == '\n')
+    {
+        consoleLine[consoleLength] = 0;
+        if (consoleLength > 0)
+            processConsoleLine();
+        consoleLength = 0;
+    }
+    else if (consoleLength < (int)sizeof(consoleLine) - 1)
+        consoleLine[consoleLength++] = toupper(in_byte);
+}
+
+void GVRET_Comm_Handler::processConsoleLine()
+{
+    if (!strcmp(consoleLine, "IDSTATS"))
+    {
+        sendString("Bus ID       Count      Mean(us)   Min(us)    Max(us)    Jitter(us) Len Data\r\n");
+        dumpSlot = 0;
+    }
+    else if (!strcmp(consoleLine, "IDSTATS RESET"))
+    {
+        canManager.clearIDStats();
+        sendString("ID statistics cleared\r\n");
+    }
+    else if (!strcmp(consoleLine, "BUSLOAD"))
+    {
+        char line[80];
+        for (int i = 0; i < SysSettings.numBuses; i++)
+        {
+            uint16_t now = canManager.getBusLoadInstant(i);
+            uint16_t avg = canManager.getBusLoad(i);
+            uint16_t peak = canManager.getBusLoadPeak(i);
+            sprintf(line, "CAN%i load now %u.%u%% avg %u.%u%% peak %u.%u%%\r\n", i,
+                    now / 10, now % 10, avg / 10, avg % 10, peak / 10, peak % 10);
+            sendCharString(line);
+        }
+    }
+    else if (!strcmp(consoleLine, "DRAIN"))
+    {
+        char line[120];
+        sprintf(line, "Drain gap max %u us, driver queue max %i, dropped frames serial %u wifi %u\r\n",
+                (unsigned)canManager.getMaxServiceGap(), canManager.getMaxQueueDepth(),
+                (unsigned)serialGVRET.getDroppedFrames(), (unsigned)wifiGVRET.getDroppedFrames());
+        sendCharString(line);
+    }
+    else if (!strcmp(consoleLine, "DRAIN RESET"))
+    {
+        canManager.resetDrainStats();
+        serialGVRET.resetCounters();
+        wifiGVRET.resetCounters();
+        sendString("Drain statistics cleared\r\n");
+    }
+    else if (!strcmp(consoleLine, "STATS"))
+    {
+        sendStatsLog();
+    }
+    else if (!strcmp(consoleLine, "STATS RESET"))
+    {
+        resetStats();
+        sendString("Driver and buffer statistics cleared\r\n");
+    }
+    else if (!strcmp(consoleLine, "BUSLOAD RESET"))
+    {
+        canManager.resetBusLoadPeak();
+        sendString("Bus load peaks cleared\r\n");
+    }
+}
+
+// Continue a running console dump, a few rows at a time so the output ring never overflows
+void GVRET_Comm_Handler::loop()
+{
+    char line[120];
+    ID_STAT stat;
+    uint32_t sent, failed;
+
+    // PROTO_BULK_TX frames of this link are all out
+    if (bulkPending && canManager.takeScheduleReport(this, sent, failed))
+    {
+        uint8_t reply[11] = {0xF1, PROTO_BULK_TX, BULK_TX_DONE};
+        for (int b = 0; b < 4; b++)
+        {
+            reply[3 + b] = (uint8_t)(sent >> (8 * b));
+            reply[7 + b] = (uint8_t)(failed >> (8 * b));
+        }
+        sendBytesToBuffer(reply, 11);
+        bulkPending = false;
+    }
+
+    while (dumpSlot >= 0 && numFreeBytes() > sizeof(line))
+    {
+        if (dumpSlot >= canManager.getIDCount())
+        {
+            dumpSlot = -1;
+            break;
+        }
+        if (canManager.getIDStat(dumpSlot++, stat))
+        {
+            int len = sprintf(line, "%-3u %-8X %-10u %-10u %-10u %-10u %-10u %-3u", stat.bus, (unsigned)stat.id,
+                              (unsigned)stat.count, (unsigned)stat.meanPeriod, (unsigned)stat.minPeriod,
+                              (unsigned)stat.maxPeriod, (unsigned)stat.jitter, stat.length);
+            for (int c = 0; c < stat.length && c < 8; c++)
+                len += sprintf(line + len, " %02X", stat.data[c]);
+            strcpy(line + len, "\r\n");
+            sendCharString(line);
+        }
+    }
+}
@@ -18,7 +18,15 @@ enum STATE {
     SET_SINGLEWIRE_MODE,
     SET_SYSTYPE,
     ECHO_CAN_FRAME,
-    SETUP_EXT_BUSES
+    SETUP_EXT_BUSES,
+    SET_BATCH_MODE,
+    SET_COMPRESSION,
+    SET_DELTA_MODE,
+    SET_FORWARD_MODE,
+    SET_RATE_LIMIT,
+    GET_ID_STATS,
+    GET_DRIVER_STATS,
+    BULK_TX
 };
 
 enum GVRET_PROTOCOL
@@ -41,13 +49,35 @@ enum GVRET_PROTOCOL
     PROTO_BUILD_FD_FRAME = 20,
     PROTO_SETUP_FD = 21,
     PROTO_GET_FD = 22,
+    PROTO_BATCH_FRAMES = 23,
+    PROTO_SET_COMPRESSION = 24,
+    PROTO_SET_DELTA_MODE = 25,
+    PROTO_SET_FORWARD_MODE = 26,
+    PROTO_SET_RATE_LIMIT = 27,
+    PROTO_GET_ID_STATS = 28,
+    PROTO_GET_DRIVER_STATS = 29,
+    PROTO_ERROR_EVENT = 30, // device -> host only: bus error / state change from the driver
+    PROTO_BULK_TX = 31,
 };
 
+#define BULK_TX_TIMED 0x01  // PROTO_BULK_TX flag: every record starts with a delay(4) in us
+#define BULK_TX_ACK 0       // PROTO_BULK_TX reply kinds
+#define BULK_TX_DONE 1
+
+#define ID_STATS_PER_PACKET 8 // records in one PROTO_GET_ID_STATS reply
+#define ID_STATS_RECORD_SIZE 34
+#define DRIVER_STATS_VALUES 18 // u32 values in a PROTO_GET_DRIVER_STATS reply
+
 class GVRET_Comm_Handler: public CommBuffer
 {
 public:
     GVRET_Comm_Handler();
     void processIncomingByte(uint8_t in_byte);
+    void processIncomingBytes(const uint8_t *bytes, size_t length);
+    void loop();
+    void setCompressedMode(bool state);
+    bool getCompressedMode();
+    void sendStatsLog();
     
 private:
     CAN_FRAME build_out_frame;
@@ -57,6 +87,26 @@ private:
     int step;
     STATE state;
     uint32_t build_int;
+    bool compressedMode; // WiFi link only: mode of the client whose input is being parsed
+
+    // text commands accepted while the link is not in binary mode
+    char consoleLine[32];
+    int consoleLength;
+    int dumpSlot; // next ID stats row to print, -1 = no dump running
+
+    // PROTO_BULK_TX packet being received
+    uint8_t bulkCount;    // records still to come
+    uint8_t bulkFlags;
+    uint8_t bulkAccepted; // records that made it into the schedule
+    int bulkPos;          // bytes of the current record in buff
+    bool bulkPending;     // frames were scheduled, send BULK_TX_DONE once they are out
 
     uint8_t checksumCalc(uint8_t *buffer, int length);
+    void sendIDStats(uint16_t start);
+    void sendDriverStats(bool reset);
+    void resetStats();
+    void processBulkTXByte(uint8_t in_byte);
+    void finishBulkTX();
+    void processConsoleByte(uint8_t in_byte);
+    void processConsoleLine();
 };
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include "id_stats.h"
+
+IDStats::IDStats()
+{
+    clear();
+}
+
+void IDStats::clear()
+{
+    memset(count, 0, sizeof(count));
+}
+
+// Account one frame of the ID in this slot. stamp is in microseconds.
+void IDStats::update(int slot, uint32_t stamp, uint8_t len, const uint8_t *payload)
+{
+    if (count[slot] == 0)
+    {
+        lastPeriod[slot] = 0;
+        minPeriod[slot] = 0xFFFFFFFF;
+        maxPeriod[slot] = 0;
+        jitter[slot] = 0;
+        periodSum[slot] = 0;
+    }
+    else
+    {
+        uint32_t period = stamp - lastStamp[slot];
+        if (period < minPeriod[slot])
+            minPeriod[slot] = period;
+        if (period > maxPeriod[slot])
+            maxPeriod[slot] = period;
+        periodSum[slot] += period;
+        if (count[slot] > 1)
+        {
+            // J += (|D| - J) / 16, kept scaled by 16
+            uint32_t diff = (period > lastPeriod[slot]) ? period - lastPeriod[slot] : lastPeriod[slot] - period;
+            jitter[slot] += diff - ((jitter[slot] + 8) >> 4);
+        }
+        lastPeriod[slot] = period;
+    }
+    count[slot]++;
+    lastStamp[slot] = stamp;
+    length[slot] = len;
+    memcpy(data[slot], payload, (len < 8) ? len : 8);
+}
+
+bool IDStats::get(IDTable &table, int slot, ID_STAT &stat)
+{
+    if (slot < 0 || slot >= table.count() || count[slot] == 0)
+        return false;
+
+    stat.id = table.getID(slot);
+    stat.extended = table.isExtended(slot);
+    stat.bus = table.getBus(slot);
+    stat.count = count[slot];
+    if (count[slot] > 1)
+    {
+        stat.meanPeriod = periodSum[slot] / (count[slot] - 1);
+        stat.minPeriod = minPeriod[slot];
+    }
+    else
+    {
+        stat.meanPeriod = 0;
+        stat.minPeriod = 0;
+    }
+    stat.maxPeriod = maxPeriod[slot];
+    stat.jitter = (jitter[slot] + 8) >> 4;
+    stat.length = length[slot];
+    memset(stat.data, 0, 8);
+    memcpy(stat.data, data[slot], (length[slot] < 8) ? length[slot] : 8);
+    return true;
+}
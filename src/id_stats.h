@@ -0,0 +1,43 @@
+#pragma once
+#include <Arduino.h>
+#include "id_table.h"
+
+// Snapshot of the statistics of one ID, periods and jitter in microseconds
+struct ID_STAT
+{
+    uint32_t id;
+    bool extended;
+    uint8_t bus;
+    uint32_t count;
+    uint32_t meanPeriod;
+    uint32_t minPeriod;
+    uint32_t maxPeriod;
+    uint32_t jitter;
+    uint8_t length;  // DLC of the last frame (in bytes)
+    uint8_t data[8]; // first 8 bytes of the last payload
+};
+
+/*
+Per-ID frame statistics in fixed memory, indexed by IDTable slot so updating costs a
+handful of stores per frame. Jitter is the RFC 3550 style running estimate of the
+difference between consecutive periods.
+*/
+class IDStats
+{
+public:
+    IDStats();
+    void clear();
+    void update(int slot, uint32_t stamp, uint8_t length, const uint8_t *data);
+    bool get(IDTable &table, int slot, ID_STAT &stat);
+
+private:
+    uint32_t count[ID_TABLE_SLOTS];
+    uint32_t lastStamp[ID_TABLE_SLOTS];
+    uint32_t lastPeriod[ID_TABLE_SLOTS];
+    uint32_t minPeriod[ID_TABLE_SLOTS];
+    uint32_t maxPeriod[ID_TABLE_SLOTS];
+    uint32_t jitter[ID_TABLE_SLOTS]; // scaled by 16
+    uint64_t periodSum[ID_TABLE_SLOTS];
+    uint8_t length[ID_TABLE_SLOTS];
+    uint8_t data[ID_TABLE_SLOTS][8];
+};
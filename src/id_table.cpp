@@ -0,0 +1,80 @@
+#include "id_table.h"
+
+IDTable::IDTable()
+{
+    clear();
+}
+
+void IDTable::clear()
+{
+    memset(stdIndex, 0, sizeof(stdIndex));
+    memset(hashIndex, 0, sizeof(hashIndex));
+    used = 0;
+}
+
+int IDTable::find(uint32_t id, bool extended, int bus)
+{
+    return lookup(id, extended, bus, false);
+}
+
+int IDTable::findOrAdd(uint32_t id, bool extended, int bus)
+{
+    return lookup(id, extended, bus, true);
+}
+
+int IDTable::count()
+{
+    return used;
+}
+
+uint32_t IDTable::getID(int slot)
+{
+    return slotKey[slot] & 0x7FFFFFFF;
+}
+
+bool IDTable::isExtended(int slot)
+{
+    return (slotKey[slot] & 0x80000000ul) ? true : false;
+}
+
+int IDTable::getBus(int slot)
+{
+    return slotBus[slot];
+}
+
+int IDTable::lookup(uint32_t id, bool extended, int bus, bool add)
+{
+    uint32_t key = id | (extended ? 0x80000000ul : 0);
+
+    // fast path: direct index
+    if (!extended && bus == 0 && id < 2048)
+    {
+        if (stdIndex[id])
+            return stdIndex[id] - 1;
+        if (!add || used >= ID_TABLE_SLOTS)
+            return -1;
+        slotKey[used] = key;
+        slotBus[used] = 0;
+        stdIndex[id] = ++used;
+        return used - 1;
+    }
+
+    uint32_t h = ((key ^ ((uint32_t)bus << 24)) * 2654435761u) >> (32 - ID_TABLE_HASH_BITS);
+    for (int i = 0; i < ID_TABLE_HASH_SIZE; i++)
+    {
+        uint16_t *bucket = &hashIndex[(h + i) & (ID_TABLE_HASH_SIZE - 1)];
+        if (*bucket == 0)
+        {
+            if (!add || used >= ID_TABLE_SLOTS)
+                return -1;
+            slotKey[used] = key;
+            slotBus[used] = bus;
+            *bucket = ++used;
+            return used - 1;
+        }
+        int slot = *bucket - 1;
+        if (slotKey[slot] == key && slotBus[slot] == bus)
+            return slot;
+    }
+    return -1;
+}
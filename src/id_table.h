@@ -0,0 +1,35 @@
+#pragma once
+#include <Arduino.h>
+
+#define ID_TABLE_EXT_SLOTS 256  // room for extended IDs and IDs on other buses next to all standard ones
+#define ID_TABLE_SLOTS (2048 + ID_TABLE_EXT_SLOTS) // distinct (bus, id) pairs tracked, shared by all per-ID features
+#define ID_TABLE_HASH_BITS 11   // buckets for extended IDs and for standard IDs on other buses
+#define ID_TABLE_HASH_SIZE (1 << ID_TABLE_HASH_BITS)
+
+/*
+Maps a (bus, id, extended) triple to a dense slot number 0..ID_TABLE_SLOTS-1 so per-ID
+state can live in plain fixed size arrays. Standard IDs on bus 0 (the common case) are
+indexed directly, everything else goes through a small open addressed hash.
+Slots are handed out in order of first appearance and stay valid until clear().
+*/
+class IDTable
+{
+public:
+    IDTable();
+    void clear();
+    int find(uint32_t id, bool extended, int bus);
+    int findOrAdd(uint32_t id, bool extended, int bus); // -1 once all slots are used
+    int count();
+    uint32_t getID(int slot);
+    bool isExtended(int slot);
+    int getBus(int slot);
+
+private:
+    uint16_t stdIndex[2048];                // slot + 1 for bus 0 standard IDs, 0 = unused
+    uint16_t hashIndex[ID_TABLE_HASH_SIZE]; // slot + 1, 0 = empty bucket
+    uint32_t slotKey[ID_TABLE_SLOTS];       // id | extended << 31
+    uint8_t slotBus[ID_TABLE_SLOTS];
+    uint16_t used;
+
+    int lookup(uint32_t id, bool extended, int bus, bool add);
+};
@@ -0,0 +1,203 @@
+#include "lz_stream.h"
+#include <string.h>
+
+static inline uint32_t _read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t _hash(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the remainder of a length that did not fit in its 4 bit token nibble
+static inline uint8_t *_writeLength(uint8_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emit literals plus (if matchLen != 0) one back reference
+static uint8_t *_emitSequence(uint8_t *op, const uint8_t *literals, size_t litLen, size_t offset, size_t matchLen)
+{
+    uint8_t *token = op++;
+    size_t ml = matchLen ? (matchLen - LZ_MIN_MATCH) : 0;
+
+    *token = (uint8_t)(((litLen < 15) ? litLen : 15) << 4);
+    if (litLen >= 15)
+        op = _writeLength(op, litLen - 15);
+    memcpy(op, literals, litLen);
+    op += litLen;
+
+    if (matchLen)
+    {
+        *token |= (uint8_t)((ml < 15) ? ml : 15);
+        *op++ = (uint8_t)(offset & 0xFF);
+        *op++ = (uint8_t)(offset >> 8);
+        if (ml >= 15)
+            op = _writeLength(op, ml - 15);
+    }
+    return op;
+}
+
+LZStreamEncoder::LZStreamEncoder()
+{
+    reset();
+}
+
+void LZStreamEncoder::reset()
+{
+    memset(hashTable, 0, sizeof(hashTable));
+    historyLength = 0;
+}
+
+size_t LZStreamEncoder::compress(const uint8_t *in, size_t len, uint8_t *out)
+{
+    if (len > LZ_BLOCK_SIZE)
+        len = LZ_BLOCK_SIZE;
+
+    memcpy(&window[historyLength], in, len);
+    size_t pos = historyLength;
+    size_t anchor = pos;
+    size_t end = historyLength + len;
+    uint8_t *op = out;
+
+    // greedy parse, one hash probe per position
+    while (pos + LZ_MIN_MATCH <= end)
+    {
+        uint32_t seq = _read32(&window[pos]);
+        uint32_t h = _hash(seq);
+        size_t cand = hashTable[h];
+        hashTable[h] = (uint16_t)(pos + 1);
+
+        if (cand && _read32(&window[cand - 1]) == seq)
+        {
+            cand--;
+            size_t matchLen = LZ_MIN_MATCH;
+            while (pos + matchLen < end && window[cand + matchLen] == window[pos + matchLen])
+                matchLen++;
+            op = _emitSequence(op, &window[anchor], pos - anchor, pos - cand, matchLen);
+            pos += matchLen;
+            anchor = pos;
+        }
+        else
+            pos++;
+    }
+    op = _emitSequence(op, &window[anchor], end - anchor, 0, 0);
+
+    // keep the last LZ_WINDOW_SIZE bytes as history and rebase the hash table
+    if (end > LZ_WINDOW_SIZE)
+    {
+        size_t shift = end - LZ_WINDOW_SIZE;
+        memmove(window, &window[shift], LZ_WINDOW_SIZE);
+        for (int i = 0; i < LZ_HASH_SIZE; i++)
+            hashTable[i] = (hashTable[i] > shift) ? (uint16_t)(hashTable[i] - shift) : 0;
+        historyLength = LZ_WINDOW_SIZE;
+    }
+    else
+        historyLength = end;
+
+    return op - out;
+}
+
+LZStreamDecoder::LZStreamDecoder()
+{
+    reset();
+}
+
+void LZStreamDecoder::reset()
+{
+    historyLength = 0;
+}
+
+void LZStreamDecoder::slide(size_t end)
+{
+    if (end > LZ_WINDOW_SIZE)
+    {
+        memmove(window, &window[end - LZ_WINDOW_SIZE], LZ_WINDOW_SIZE);
+        historyLength = LZ_WINDOW_SIZE;
+    }
+    else
+        historyLength = end;
+}
+
+void LZStreamDecoder::addStored(const uint8_t *in, size_t len)
+{
+    if (len > LZ_BLOCK_SIZE)
+        len = LZ_BLOCK_SIZE;
+    memcpy(&window[historyLength], in, len);
+    slide(historyLength + len);
+}
+
+int LZStreamDecoder::decompress(const uint8_t *in, size_t inLen, uint8_t *out, size_t rawLen)
+{
+    if (rawLen > LZ_BLOCK_SIZE)
+        return -1;
+
+    const uint8_t *ip = in;
+    const uint8_t *iend = in + inLen;
+    size_t start = historyLength;
+    size_t op = start;
+    size_t end = start + rawLen;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                litLen += b;
+            } while (b == 255);
+        }
+        if (litLen > (size_t)(iend - ip) || op + litLen > end)
+            return -1;
+        memcpy(&window[op], ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (op == end)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = (token & 0xF);
+        if (matchLen == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                matchLen += b;
+            } while (b == 255);
+        }
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + matchLen > end)
+            return -1;
+        // byte by byte so overlapping matches repeat correctly
+        for (size_t i = 0; i < matchLen; i++, op++)
+            window[op] = window[op - offset];
+    }
+    if (op != end)
+        return -1;
+
+    memcpy(out, &window[start], rawLen);
+    slide(end);
+    return (int)rawLen;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Small LZ77 stream codec used for the compressed GVRET stream on the WiFi port.
+Every block is compressed against the previous LZ_WINDOW_SIZE bytes of the stream,
+so repeated IDs/payloads from earlier flushes still match. RAM is fixed: the window,
+one block and a hash table of LZ_HASH_SIZE 16 bit positions.
+
+Block format (LZ4 style sequences):
+  token: high nibble = literal count, low nibble = match length - 4
+         (15 in either nibble means more length bytes follow: 255, 255, ..., rest)
+  [literal length bytes] literals
+  if the block is not complete yet: offset(2, little endian) [match length bytes]
+The final sequence of a block only carries literals (possibly zero of them).
+
+This file has no Arduino dependencies so a host side client can build the decoder as is.
+*/
+
+#define LZ_WINDOW_SIZE 2048
+#define LZ_BLOCK_SIZE 1024
+#define LZ_HASH_BITS 10
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MIN_MATCH 4
+// worst case output for one incompressible block
+#define LZ_MAX_COMPRESSED_SIZE (LZ_BLOCK_SIZE + (LZ_BLOCK_SIZE / 255) + 16)
+
+class LZStreamEncoder
+{
+public:
+    LZStreamEncoder();
+    void reset();
+    // compress len (<= LZ_BLOCK_SIZE) bytes; out needs LZ_MAX_COMPRESSED_SIZE bytes
+    size_t compress(const uint8_t *in, size_t len, uint8_t *out);
+
+private:
+    uint8_t window[LZ_WINDOW_SIZE + LZ_BLOCK_SIZE];
+    uint16_t hashTable[LZ_HASH_SIZE]; // position + 1 in window, 0 = empty
+    size_t historyLength;
+};
+
+class LZStreamDecoder
+{
+public:
+    LZStreamDecoder();
+    void reset();
+    // returns rawLen on success, -1 if the block is corrupt
+    int decompress(const uint8_t *in, size_t inLen, uint8_t *out, size_t rawLen);
+    // keep the history in sync for blocks that were sent uncompressed
+    void addStored(const uint8_t *in, size_t len);
+
+private:
+    uint8_t window[LZ_WINDOW_SIZE + LZ_BLOCK_SIZE];
+    size_t historyLength;
+
+    void slide(size_t end);
+};
@@ -0,0 +1,127 @@
+#include "payload_delta.h"
+#include <string.h>
+
+static inline uint32_t _deltaHash(uint32_t key, uint8_t bus)
+{
+    return ((key ^ ((uint32_t)bus << 24)) * 2654435761u) >> 16;
+}
+
+PayloadDeltaEncoder::PayloadDeltaEncoder(uint8_t keyframeInterval)
+{
+    this->keyframeInterval = keyframeInterval;
+    clear();
+}
+
+// Forget everything, the next frame of every ID goes out as a keyframe
+void PayloadDeltaEncoder::clear()
+{
+    memset(table, 0, sizeof(table));
+}
+
+/*
+The slot (key, bus) uses: its entry if it is in the probe window of its hash, else the first
+free slot of the window, else the home slot, evicting whatever is there. Encoder and decoder
+both place IDs this way, so a decoder that sees the same stream holds exactly the IDs the
+encoder sends deltas for.
+*/
+static DELTA_ENTRY *_deltaSlot(DELTA_ENTRY *table, uint32_t key, uint8_t bus, bool &found)
+{
+    uint32_t h = _deltaHash(key, bus);
+    DELTA_ENTRY *freeSlot = nullptr;
+
+    for (int i = 0; i < DELTA_MAX_PROBES; i++)
+    {
+        DELTA_ENTRY *e = &table[(h + i) & (DELTA_TABLE_SIZE - 1)];
+        if (!e->used)
+        {
+            if (!freeSlot)
+                freeSlot = e;
+            continue;
+        }
+        if (e->key == key && e->bus == bus)
+        {
+            found = true;
+            return e;
+        }
+    }
+    found = false;
+    return freeSlot ? freeSlot : &table[h & (DELTA_TABLE_SIZE - 1)];
+}
+
+int PayloadDeltaEncoder::encode(uint32_t id, bool extended, uint8_t bus, uint8_t length, const uint8_t *data, uint8_t *out)
+{
+    if (length > 8)
+        return 0;
+
+    uint32_t key = id | (extended ? 0x80000000ul : 0);
+    bool found;
+    DELTA_ENTRY *entry = _deltaSlot(table, key, bus, found);
+
+    if (!found || entry->length != length || entry->sinceKeyframe >= keyframeInterval)
+    {
+        // new ID (possibly evicting another one) or keyframe due
+        entry->key = key;
+        entry->bus = bus;
+        entry->used = 1;
+        entry->length = length;
+        entry->sinceKeyframe = 0;
+        memcpy(entry->data, data, length);
+        return 0;
+    }
+
+    uint8_t bitmap = 0;
+    int len = 1;
+    for (int c = 0; c < length; c++)
+    {
+        if (data[c] != entry->data[c])
+        {
+            bitmap |= (uint8_t)(1 << c);
+            out[len++] = data[c];
+            entry->data[c] = data[c];
+        }
+    }
+    out[0] = bitmap;
+    entry->sinceKeyframe++;
+    return len;
+}
+
+PayloadDeltaDecoder::PayloadDeltaDecoder()
+{
+    clear();
+}
+
+void PayloadDeltaDecoder::clear()
+{
+    memset(table, 0, sizeof(table));
+}
+
+void PayloadDeltaDecoder::keyframe(uint32_t id, bool extended, uint8_t bus, uint8_t length, const uint8_t *data)
+{
+    if (length > 8)
+        return;
+    uint32_t key = id | (extended ? 0x80000000ul : 0);
+    bool found;
+    DELTA_ENTRY *e = _deltaSlot(table, key, bus, found);
+    e->key = key;
+    e->bus = bus;
+    e->used = 1;
+    e->length = length;
+    memcpy(e->data, data, length);
+}
+
+int PayloadDeltaDecoder::apply(uint32_t id, bool extended, uint8_t bus, uint8_t length, const uint8_t *delta, uint8_t *data)
+{
+    bool found;
+    DELTA_ENTRY *e = _deltaSlot(table, id | (extended ? 0x80000000ul : 0), bus, found);
+    if (!found || e->length != length)
+        return -1;
+    uint8_t bitmap = delta[0];
+    int used = 1;
+    for (int c = 0; c < length; c++)
+    {
+        if (bitmap & (1 << c))
+            e->data[c] = delta[used++];
+    }
+    memcpy(data, e->data, length);
+    return used;
+}
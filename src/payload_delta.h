@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Per-ID payload delta coding for the binary GVRET stream (PROTO_SET_DELTA_MODE).
+The encoder remembers the last payload it sent for every (bus, id) and, when the
+length is unchanged, emits only
+  bitmap(1)      bit n set = data byte n changed
+  changed bytes  new values of the set bytes, in order
+Every keyframeInterval frames of an ID (and whenever an ID is new, evicted or changes
+length) the full payload is sent instead so a client can resynchronize.
+
+The encoder forgets everything whenever a frame could not be queued (the client would
+miss a payload the table assumes it has) and when the mode is set. The device then sends a
+delta reset packet before the next frame, and the client has to clear its decoder on it:
+  0xF1, PROTO_SET_DELTA_MODE, time(4), id(4) = 0, len | bus = 0 (bit 7 clear), checksum(1)
+It has the layout of a single frame delta packet, whose len | bus byte always has bit 7 set.
+
+No Arduino dependencies: PayloadDeltaDecoder is the matching host side reconstructor. It
+uses the same table size and placement rule as the encoder, so fed the same stream it
+evicts the same IDs and never needs more room than the encoder has.
+*/
+
+#define DELTA_TABLE_SIZE 256 // IDs remembered by the encoder (power of two)
+#define DELTA_MAX_PROBES 8
+
+struct DELTA_ENTRY
+{
+    uint32_t key; // id | extended << 31
+    uint8_t bus;
+    uint8_t length;
+    uint8_t sinceKeyframe;
+    uint8_t used;
+    uint8_t data[8];
+};
+
+class PayloadDeltaEncoder
+{
+public:
+    PayloadDeltaEncoder(uint8_t keyframeInterval);
+    void clear();
+    // Remember this payload. Returns the size of the delta written to out (1..9 bytes, just
+    // the bitmap if nothing changed) or 0 if the full payload has to be sent for this frame.
+    int encode(uint32_t id, bool extended, uint8_t bus, uint8_t length, const uint8_t *data, uint8_t *out);
+
+private:
+    DELTA_ENTRY table[DELTA_TABLE_SIZE];
+    uint8_t keyframeInterval;
+};
+
+class PayloadDeltaDecoder
+{
+public:
+    PayloadDeltaDecoder();
+    // Call on a delta reset packet
+    void clear();
+    // A full payload was received for this ID
+    void keyframe(uint32_t id, bool extended, uint8_t bus, uint8_t length, const uint8_t *data);
+    // Apply a delta record. delta points at the bitmap. Writes the reconstructed payload to
+    // data and returns the number of delta bytes consumed, or -1 if the ID is unknown
+    // (only possible if the stream was cut or a reset packet was missed).
+    int apply(uint32_t id, bool extended, uint8_t bus, uint8_t length, const uint8_t *delta, uint8_t *data);
+
+private:
+    DELTA_ENTRY table[DELTA_TABLE_SIZE];
+};
@@ -10,6 +10,8 @@ static IPAddress broadcastAddr(255, 255, 255, 255);
 WiFiManager::WiFiManager()
 {
     lastBroadcast = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clientCompressed[i] = false;
 }
 
 void WiFiManager::setup()
@@ -120,6 +122,13 @@ void WiFiManager::loop()
                                 Serial.print(i);
                                 Serial.print(" from ");
                                 Serial.println(SysSettings.clientNodes[i].remoteIP());
+                                // new clients get a plain stream with single full frame packets
+                                // until they negotiate batching / deltas / compression again.
+                                // Compression belongs to the slot, other clients keep theirs.
+                                wifiGVRET.setBatchSize(0);
+                                wifiGVRET.setDeltaMode(0);
+                                clientCompressed[i] = false;
+                                lzEncoder[i].reset();
                             }
                             break;
                         }
@@ -163,11 +172,23 @@ void WiFiManager::loop()
                 {
                     if (SysSettings.clientNodes[i] && SysSettings.clientNodes[i].connected())
                     {
-                        while (SysSettings.clientNodes[i].available())
+                        int clientAvail;
+                        while ((clientAvail = SysSettings.clientNodes[i].available()) > 0)
                         {
-                            uint8_t inByt = SysSettings.clientNodes[i].read();
+                            uint8_t rxBlock[SER_RX_BLOCK];
+                            int got = SysSettings.clientNodes[i].read(rxBlock, (clientAvail < SER_RX_BLOCK) ? clientAvail : SER_RX_BLOCK);
+                            if (got <= 0)
+                                break;
                             SysSettings.isWifiActive = true;
-                            wifiGVRET.processIncomingByte(inByt);
+                            // the handler parses one client at a time, so it sees that client's mode
+                            wifiGVRET.setCompressedMode(clientCompressed[i]);
+                            wifiGVRET.processIncomingBytes(rxBlock, got);
+                            if (wifiGVRET.getCompressedMode() != clientCompressed[i])
+                            {
+                                // switching starts a fresh dictionary on both ends
+                                clientCompressed[i] = wifiGVRET.getCompressedMode();
+                                lzEncoder[i].reset();
+                            }
                         }
                     }
                     else if (SysSettings.clientNodes[i])
@@ -209,15 +230,66 @@ void WiFiManager::loop()
 
 void WiFiManager::sendBufferedData()
 {
-    // Push GVRET buffered output to all connected telnet clients
+    // Push GVRET buffered output to all connected telnet clients, as is or as compressed
+    // blocks depending on what each client asked for. Replies and frames sit in two rings
+    // that may each wrap, so this takes a few contiguous chunks. Only what is buffered on
+    // entry is sent, frames queued meanwhile stay for next time.
+    size_t pending = wifiGVRET.numAvailableBytes();
+    size_t wifiLength;
+    uint8_t *buff;
+    while (pending > 0 && ((buff = wifiGVRET.getBufferedBytes(wifiLength)), wifiLength > 0))
+    {
+        if (wifiLength > pending)
+            wifiLength = pending;
+        pending -= wifiLength;
+        sendToClients(buff, wifiLength);
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (!clientCompressed[i] || !SysSettings.clientNodes[i] || !SysSettings.clientNodes[i].connected())
+                continue;
+            for (size_t pos = 0; pos < wifiLength; pos += LZ_BLOCK_SIZE)
+            {
+                size_t blockLen = wifiLength - pos;
+                if (blockLen > LZ_BLOCK_SIZE)
+                    blockLen = LZ_BLOCK_SIZE;
+                sendCompressedBlock(i, &buff[pos], blockLen);
+            }
+        }
+        wifiGVRET.consumeBufferedBytes(wifiLength);
+    }
+}
+
+// Plain stream to every client that has not switched to compressed blocks
+void WiFiManager::sendToClients(const uint8_t *data, size_t length)
+{
     for (int i = 0; i < MAX_CLIENTS; i++)
     {
-        size_t wifiLength = wifiGVRET.numAvailableBytes();
-        uint8_t *buff = wifiGVRET.getBufferedBytes();
-        if (SysSettings.clientNodes[i] && SysSettings.clientNodes[i].connected() && wifiLength)
+        if (!clientCompressed[i] && SysSettings.clientNodes[i] && SysSettings.clientNodes[i].connected())
         {
-            SysSettings.clientNodes[i].write(buff, wifiLength);
+            SysSettings.clientNodes[i].write(data, length);
         }
     }
-    wifiGVRET.clearBufferedBytes();
+}
+
+/*
+Compressed stream block (see lz_stream.h for the payload format):
+  0xF1, PROTO_SET_COMPRESSION, raw length(2), compressed length(2), payload
+A compressed length of 0 means the payload is the raw block, stored because it
+did not shrink. The client feeds the decoded bytes into its normal GVRET parser.
+*/
+void WiFiManager::sendCompressedBlock(int client, const uint8_t *data, size_t length)
+{
+    size_t compLen = lzEncoder[client].compress(data, length, &compressedPacket[6]);
+    if (compLen >= length)
+    {
+        compLen = 0;
+        memcpy(&compressedPacket[6], data, length);
+    }
+    compressedPacket[0] = 0xF1;
+    compressedPacket[1] = PROTO_SET_COMPRESSION;
+    compressedPacket[2] = (uint8_t)(length & 0xFF);
+    compressedPacket[3] = (uint8_t)(length >> 8);
+    compressedPacket[4] = (uint8_t)(compLen & 0xFF);
+    compressedPacket[5] = (uint8_t)(compLen >> 8);
+    SysSettings.clientNodes[client].write(compressedPacket, 6 + (compLen ? compLen : length));
 }
@@ -2,6 +2,8 @@
 #include <WiFi.h>
 #include <ESPmDNS.h>
 #include <WiFiUdp.h>
+#include "config.h"
+#include "lz_stream.h"
 //#include <ArduinoOTA.h>
 
 class WiFiManager
@@ -19,4 +21,11 @@ private:
     WiFiClient wifiClient;
     WiFiUDP wifiUDPServer;
     uint32_t lastBroadcast;
+    // compression is negotiated per telnet client, each with its own dictionary
+    LZStreamEncoder lzEncoder[MAX_CLIENTS];
+    bool clientCompressed[MAX_CLIENTS];
+    uint8_t compressedPacket[6 + LZ_MAX_COMPRESSED_SIZE];
+
+    void sendToClients(const uint8_t *data, size_t length);
+    void sendCompressedBlock(int client, const uint8_t *data, size_t length);
 };